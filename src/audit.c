@@ -0,0 +1,315 @@
+/*
+    mkinfo -- integrity audit of the titlesets in a DVD directory
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+#include "config.h"
+#include "compat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "mkinfo.h"
+#include "mi-internal.h"
+#include "ifo-layout.h"
+
+#define AUDIT_CHUNK (256 * 1024)
+
+enum {F_IFO, F_BUP, F_VOB}; /* kinds of titleset file */
+
+struct vtsfile { /* a file belonging to a titleset, as found in the directory */
+    char name[13]; /* VTS_nn_m.EXT */
+    int vtsn;
+    int kind;
+    uint64_t size;
+};
+
+struct vtsaudit { /* what was learned about one titleset */
+    const struct vtsfile *ifo, *bup;
+    uint64_t totalsize; /* of all files */
+};
+
+static int classify(const char *name, int *vtsn)
+/* returns the kind of titleset file name is, or -1 if it isn't one. */
+{
+  if
+    (
+        strlen(name) != 12
+    ||
+        strncasecmp(name, "VTS_", 4) != 0
+    ||
+        name[6] != '_'
+    ||
+        name[8] != '.'
+    ||
+        name[4] < '0' || name[4] > '9' || name[5] < '0' || name[5] > '9'
+    ||
+        name[7] < '0' || name[7] > '9'
+    )
+    return -1;
+  *vtsn = (name[4] - '0') * 10 + (name[5] - '0');
+  if (!strcasecmp(name + 7, "0.IFO"))
+    return F_IFO;
+  if (!strcasecmp(name + 7, "0.BUP"))
+    return F_BUP;
+  if (!strcasecmp(name + 9, "VOB"))
+    return F_VOB;
+  return -1;
+} /*classify*/
+
+static int statsize(int dirfd, const char *name, uint64_t *size)
+/* gets the size of a file in dirfd without forcing a sync of its attributes
+   with the server on network filesystems. */
+{
+#ifdef HAVE_STATX
+  struct statx stx;
+  if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_SIZE, &stx) != 0)
+    return -1;
+  *size = stx.stx_size;
+#else
+  struct stat st;
+  if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    return -1;
+  *size = st.st_size;
+#endif
+  return 0;
+} /*statsize*/
+
+static int readfull(int fd, unsigned char *buf, size_t len, off_t offset)
+/* reads up to len bytes from offset, returning fewer only at end of file, or -1 on error. */
+{
+  size_t got = 0;
+  while (got < len)
+    {
+      const ssize_t n = scan_pread(fd, buf + got, len - got, offset + got);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        } /*if*/
+      if (n == 0)
+        break;
+      got += n;
+    } /*while*/
+  return got;
+} /*readfull*/
+
+static bool audit_titleset
+(
+  const char *vtsdir,
+  int dirfd,
+  int vtsn,
+  const struct vtsaudit *va
+)
+/* checks one titleset, reporting what it finds. Returns true if it is sound. */
+{
+  static unsigned char *ifobuf, *bupbuf;
+  uint32_t ifocrc = 0, bupcrc = 0;
+  uint64_t pos = 0, diffpos = 0, numsectors = 0;
+  bool differ = false, ok = true;
+  int ifofd, bupfd = -1;
+
+  if (!ifobuf)
+    {
+      if
+        (
+            posix_memalign((void **)&ifobuf, SCAN_ALIGN, AUDIT_CHUNK) != 0
+        ||
+            posix_memalign((void **)&bupbuf, SCAN_ALIGN, AUDIT_CHUNK) != 0
+        )
+        {
+          fprintf(stderr, "ERR:  audit: out of memory\n");
+          exit(1);
+        } /*if*/
+    } /*if*/
+  ifofd = scan_openat(dirfd, va->ifo->name, O_RDONLY);
+  if (ifofd < 0)
+    {
+      printf("BAD  %s/%s: %s\n", vtsdir, va->ifo->name, strerror(errno));
+      return false;
+    } /*if*/
+  if (scan_io == SCAN_IO_CACHED)
+    posix_fadvise(ifofd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if (va->bup)
+    {
+      bupfd = scan_openat(dirfd, va->bup->name, O_RDONLY);
+      if (bupfd < 0)
+        {
+          printf("BAD  %s/%s: %s\n", vtsdir, va->bup->name, strerror(errno));
+          ok = false;
+        }
+      else if (scan_io == SCAN_IO_CACHED)
+        posix_fadvise(bupfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    } /*if*/
+  for (;;)
+    {
+      const int ni = readfull(ifofd, ifobuf, AUDIT_CHUNK, pos);
+      const int nb = bupfd >= 0 ? readfull(bupfd, bupbuf, AUDIT_CHUNK, pos) : 0;
+      if (ni < 0 || nb < 0)
+        {
+          printf("BAD  %s/VTS_%02d: read error: %s\n", vtsdir, vtsn, strerror(errno));
+          ok = false;
+          break;
+        } /*if*/
+      if (pos == 0 && ni >= (int)sizeof(struct vtsi_mat))
+        numsectors = read4(((const struct vtsi_mat *)ifobuf)->vts_last_sector) + 1ULL;
+      ifocrc = crc32c(ifocrc, ifobuf, ni);
+      bupcrc = crc32c(bupcrc, bupbuf, nb);
+      if (bupfd >= 0 && !differ && (ni != nb || memcmp(ifobuf, bupbuf, ni) != 0))
+        {
+          int i;
+          for (i = 0; i < ni && i < nb && ifobuf[i] == bupbuf[i]; i++)
+            /* find first difference */;
+          diffpos = pos + i;
+          differ = true;
+        } /*if*/
+      pos += ni;
+      if (ni < AUDIT_CHUNK && nb < AUDIT_CHUNK)
+        break;
+    } /*for*/
+  close(ifofd);
+  if (bupfd >= 0)
+    close(bupfd);
+
+  if (!va->bup)
+    {
+      printf("BAD  %s/VTS_%02d: no VTS_%02d_0.BUP\n", vtsdir, vtsn, vtsn);
+      ok = false;
+    }
+  else if (differ)
+    {
+      printf
+        (
+          "BAD  %s/VTS_%02d: IFO and BUP differ from byte %llu\n",
+          vtsdir, vtsn, (unsigned long long)diffpos
+        );
+      ok = false;
+    } /*if*/
+  if (va->ifo->size % DVD_SECTOR_SIZE != 0)
+    {
+      printf("BAD  %s/%s: size is not a whole number of sectors\n", vtsdir, va->ifo->name);
+      ok = false;
+    } /*if*/
+  if (numsectors != va->totalsize / DVD_SECTOR_SIZE)
+    {
+      printf
+        (
+          "BAD  %s/VTS_%02d: header says %llu sectors, files hold %llu\n",
+          vtsdir, vtsn,
+          (unsigned long long)numsectors,
+          (unsigned long long)(va->totalsize / DVD_SECTOR_SIZE)
+        );
+      ok = false;
+    } /*if*/
+  printf
+    (
+      "%s %s/VTS_%02d: %llu sectors, crc32c IFO %08x BUP %08x\n",
+      ok ? "OK  " : "BAD ",
+      vtsdir, vtsn,
+      (unsigned long long)numsectors,
+      ifocrc, bupcrc
+    );
+  return ok;
+} /*audit_titleset*/
+
+int audit_directory(const char *dirname)
+/* audits all the titlesets in dirname/VIDEO_TS: each VTS IFO must match its BUP,
+   and the titleset size recorded in the IFO must match the size of its files.
+   Returns the number of damaged titlesets found, or -1 if the directory cannot
+   be read. */
+{
+  struct vtsaudit vts[100];
+  struct vtsfile *files = 0;
+  int numfiles = 0, maxfiles = 0, numbad = 0, dirfd, i;
+  DIR *d;
+  struct dirent *de;
+  char *vtsdir;
+
+  vtsdir = malloc(strlen(dirname) + 10);
+  sprintf(vtsdir, "%s/VIDEO_TS", dirname);
+  dirfd = scan_openat(AT_FDCWD, vtsdir, O_RDONLY | O_DIRECTORY);
+  d = dirfd >= 0 ? fdopendir(dup(dirfd)) : 0;
+  if (!d)
+    {
+      printf("BAD  %s: %s\n", vtsdir, strerror(errno));
+      if (dirfd >= 0)
+        close(dirfd);
+      free(vtsdir);
+      return -1;
+    } /*if*/
+  /* collect all the names first, then get all their sizes in one go */
+  io_delay(IO_READDIR);
+  while ((de = readdir(d)) != 0)
+    {
+      int vtsn;
+      const int kind = classify(de->d_name, &vtsn);
+      if (kind < 0 || vtsn == 0)
+        continue;
+      if (numfiles == maxfiles)
+        {
+          maxfiles = maxfiles ? maxfiles * 2 : 32;
+          files = realloc(files, maxfiles * sizeof(struct vtsfile));
+        } /*if*/
+      strcpy(files[numfiles].name, de->d_name);
+      files[numfiles].vtsn = vtsn;
+      files[numfiles].kind = kind;
+      numfiles++;
+    } /*while*/
+  closedir(d);
+  memset(vts, 0, sizeof vts);
+  for (i = 0; i < numfiles; i++)
+    {
+      struct vtsfile * const f = &files[i];
+      if (statsize(dirfd, f->name, &f->size) != 0)
+        {
+          printf("BAD  %s/%s: %s\n", vtsdir, f->name, strerror(errno));
+          f->size = 0;
+        } /*if*/
+      vts[f->vtsn].totalsize += f->size;
+      if (f->kind == F_IFO)
+        vts[f->vtsn].ifo = f;
+      else if (f->kind == F_BUP)
+        vts[f->vtsn].bup = f;
+    } /*for*/
+  for (i = 1; i <= 99; i++)
+    {
+      if (!vts[i].ifo)
+        {
+          if (vts[i].totalsize)
+            {
+              printf("BAD  %s/VTS_%02d: no VTS_%02d_0.IFO\n", vtsdir, i, i);
+              numbad++;
+            } /*if*/
+          continue;
+        } /*if*/
+      if (!audit_titleset(vtsdir, dirfd, i, &vts[i]))
+        numbad++;
+    } /*for*/
+  close(dirfd);
+  free(files);
+  free(vtsdir);
+  return numbad;
+} /*audit_directory*/
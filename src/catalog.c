@@ -0,0 +1,350 @@
+/*
+    mkinfo -- writing a binary catalog of scanned titlesets, see catalog.h
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+#include "config.h"
+#include "compat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mkinfo.h"
+#include "mi-internal.h"
+#include "ifo-layout.h"
+#include "catalog.h"
+
+_Static_assert(sizeof(struct mkcat_header) == 96, "mkcat_header layout changed");
+_Static_assert(sizeof(struct mkcat_disc) == 16, "mkcat_disc layout changed");
+_Static_assert(sizeof(struct mkcat_titleset) == 288, "mkcat_titleset layout changed");
+
+/* offsets relative to vtsi_mat.vts_attrs */
+#define SUMMARY_MENU_VIDEO 0x000
+#define SUMMARY_TITLE_VIDEO 0x100
+#define SUMMARY_TITLE_NUMAUDIO 0x102
+#define SUMMARY_TITLE_AUDIO 0x104
+#define SUMMARY_TITLE_NUMSUBP 0x154
+#define SUMMARY_TITLE_SUBP 0x156
+
+struct catalog {
+    char *fname; /* final name of catalog */
+    char *tmpname; /* name written to until catalog_finish */
+    FILE *h;
+    uint64_t offset; /* current write position in h */
+    uint64_t numtitlesets; /* titleset records already written to h */
+    struct mkcat_disc *discs; /* array */
+    size_t numdiscs, maxdiscs;
+    uint16_t *chapters; /* array */
+    size_t numtitles, maxtitles;
+    char *strings;
+    size_t stringsize, maxstrings;
+};
+
+static void *grow(void *p, size_t *max, size_t needed, size_t elsize)
+/* ensures array p has room for needed elements, growing it geometrically. */
+{
+  if (needed > *max)
+    {
+      size_t newmax = *max ? *max : 64;
+      while (newmax < needed)
+        newmax *= 2;
+      p = realloc(p, newmax * elsize);
+      if (!p)
+        {
+          fprintf(stderr, "ERR:  catalog: out of memory\n");
+          exit(1);
+        } /*if*/
+      *max = newmax;
+    } /*if*/
+  return p;
+} /*grow*/
+
+static void cat_write(struct catalog *cat, const void *p, size_t len)
+{
+  if (len && fwrite(p, len, 1, cat->h) != 1)
+    {
+      fprintf(stderr, "ERR:  Error %d -- %s -- writing catalog %s\n", errno, strerror(errno), cat->tmpname);
+      exit(1);
+    } /*if*/
+  cat->offset += len;
+} /*cat_write*/
+
+static void cat_align(struct catalog *cat)
+/* pads the output to the next multiple of 8 bytes. */
+{
+  static const char zero[8];
+  cat_write(cat, zero, -cat->offset & 7);
+} /*cat_align*/
+
+struct catalog *catalog_create(const char *fname)
+/* starts writing a new catalog. It replaces any existing one of the same name
+   only once catalog_finish is called. */
+{
+  struct mkcat_header hdr;
+  struct catalog * const cat = calloc(1, sizeof(struct catalog));
+  cat->fname = strdup(fname);
+  cat->tmpname = malloc(strlen(fname) + 5);
+  sprintf(cat->tmpname, "%s.tmp", fname);
+  cat->h = fopen(cat->tmpname, "wb");
+  if (!cat->h)
+    {
+      fprintf(stderr, "ERR:  cannot create %s: %s\n", cat->tmpname, strerror(errno));
+      exit(1);
+    } /*if*/
+  memset(&hdr, 0, sizeof hdr); /* placeholder, filled in by catalog_finish */
+  cat_write(cat, &hdr, sizeof hdr);
+  return cat;
+} /*catalog_create*/
+
+void catalog_add(struct catalog *cat, const char *dirname, const struct toc_summary *ts)
+/* appends the titlesets previously scanned from dirname to the catalog. */
+{
+  struct mkcat_disc *disc;
+  struct mkcat_titleset rec;
+  const size_t namelen = strlen(dirname) + 1;
+  int i, j;
+
+  cat->discs = grow(cat->discs, &cat->maxdiscs, cat->numdiscs + 1, sizeof(struct mkcat_disc));
+  disc = &cat->discs[cat->numdiscs];
+  disc->name = cat->stringsize;
+  disc->first_titleset = cat->numtitlesets;
+  disc->numtitlesets = ts->numvts;
+  cat->strings = grow(cat->strings, &cat->maxstrings, cat->stringsize + namelen, 1);
+  memcpy(cat->strings + cat->stringsize, dirname, namelen);
+  cat->stringsize += namelen;
+  for (i = 0; i < ts->numvts; i++)
+    {
+      const struct vtsdef * const vd = &ts->vts[i];
+      const unsigned char * const summary = vd->mat.vts_attrs;
+      memset(&rec, 0, sizeof rec);
+      rec.disc = cat->numdiscs;
+      rec.first_title = cat->numtitles;
+      rec.numsectors = vd->numsectors;
+      rec.numtitles = vd->numtitles;
+      rec.vtsn = vd->vtsn;
+      rec.hasmenu = vd->hasmenu;
+      memcpy(rec.vtscat, vd->mat.vts_category, sizeof rec.vtscat);
+      memcpy(rec.menu_video, summary + SUMMARY_MENU_VIDEO, 2);
+      memcpy(rec.title_video, summary + SUMMARY_TITLE_VIDEO, 2);
+      rec.numaudio = read2(summary + SUMMARY_TITLE_NUMAUDIO);
+      if (rec.numaudio > 8)
+        rec.numaudio = 8;
+      rec.numsubp = read2(summary + SUMMARY_TITLE_NUMSUBP);
+      if (rec.numsubp > 32)
+        rec.numsubp = 32;
+      memcpy(rec.audio, summary + SUMMARY_TITLE_AUDIO, rec.numaudio * 8);
+      memcpy(rec.subp, summary + SUMMARY_TITLE_SUBP, rec.numsubp * 6);
+      cat_write(cat, &rec, sizeof rec);
+      cat->numtitlesets++;
+      cat->chapters = grow(cat->chapters, &cat->maxtitles, cat->numtitles + vd->numtitles, sizeof(uint16_t));
+      for (j = 0; j < vd->numtitles; j++)
+        cat->chapters[cat->numtitles++] = vd->numchapters[j];
+    } /*for*/
+  cat->numdiscs++;
+} /*catalog_add*/
+
+static const struct catalog *sorting; /* for compare_names */
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp
+    (
+      sorting->strings + sorting->discs[*(const uint32_t *)a].name,
+      sorting->strings + sorting->discs[*(const uint32_t *)b].name
+    );
+} /*compare_names*/
+
+void catalog_finish(struct catalog *cat)
+/* writes out the remaining sections and header of the catalog, and puts it in place. */
+{
+  struct mkcat_header hdr;
+  uint32_t *index;
+  size_t i;
+
+  memset(&hdr, 0, sizeof hdr);
+  memcpy(hdr.magic, MKCAT_MAGIC, sizeof hdr.magic);
+  hdr.version = MKCAT_VERSION;
+  hdr.byteorder = MKCAT_BYTEORDER;
+  hdr.numdiscs = cat->numdiscs;
+  hdr.numtitlesets = cat->numtitlesets;
+  hdr.numtitles = cat->numtitles;
+  hdr.stringsize = cat->stringsize;
+  hdr.titlesets_offset = sizeof hdr; /* written as we went along */
+
+  hdr.discs_offset = cat->offset; /* always aligned, since all records written so far are */
+  cat_write(cat, cat->discs, cat->numdiscs * sizeof(struct mkcat_disc));
+  hdr.chapters_offset = cat->offset;
+  cat_write(cat, cat->chapters, cat->numtitles * sizeof(uint16_t));
+  cat_align(cat);
+  hdr.strings_offset = cat->offset;
+  cat_write(cat, cat->strings, cat->stringsize);
+  cat_align(cat);
+
+  index = malloc((cat->numdiscs + 1) * sizeof(uint32_t));
+  for (i = 0; i < cat->numdiscs; i++)
+    index[i] = i;
+  sorting = cat;
+  qsort(index, cat->numdiscs, sizeof(uint32_t), compare_names);
+  sorting = 0;
+  hdr.index_offset = cat->offset;
+  cat_write(cat, index, cat->numdiscs * sizeof(uint32_t));
+  cat_align(cat);
+  hdr.filesize = cat->offset;
+  free(index);
+
+  if (fseek(cat->h, 0, SEEK_SET) != 0)
+    {
+      fprintf(stderr, "ERR:  cannot rewind %s: %s\n", cat->tmpname, strerror(errno));
+      exit(1);
+    } /*if*/
+  cat_write(cat, &hdr, sizeof hdr);
+  if (fclose(cat->h) != 0)
+    {
+      fprintf(stderr, "ERR:  Error %d -- %s -- closing catalog %s\n", errno, strerror(errno), cat->tmpname);
+      exit(1);
+    } /*if*/
+  if (rename(cat->tmpname, cat->fname) != 0)
+    {
+      fprintf(stderr, "ERR:  cannot rename %s to %s: %s\n", cat->tmpname, cat->fname, strerror(errno));
+      exit(1);
+    } /*if*/
+  fprintf(stderr, "INFO: Catalog %s: %lu discs, %lu titlesets\n",
+          cat->fname, (unsigned long)cat->numdiscs, (unsigned long)cat->numtitlesets);
+  free(cat->discs);
+  free(cat->chapters);
+  free(cat->strings);
+  free(cat->tmpname);
+  free(cat->fname);
+  free(cat);
+} /*catalog_finish*/
+
+static bool section_fits(const struct mkcat_header *hdr, uint64_t offset, uint64_t count, size_t size)
+/* does a section of count elements of size bytes at offset lie within the catalog,
+   starting on an 8-byte boundary like catalog_finish writes them? */
+{
+  return
+        offset % 8 == 0
+    &&
+        offset >= sizeof(struct mkcat_header)
+    &&
+        offset <= hdr->filesize
+    &&
+        count <= (hdr->filesize - offset) / size;
+} /*section_fits*/
+
+static bool catalog_consistent(const struct mkcat_header *hdr)
+/* checks that everything catalog_query will look at lies within the catalog:
+   the sections, and the discs, names and stream attributes the titlesets refer to. */
+{
+  const struct mkcat_titleset * const titlesets =
+      (const struct mkcat_titleset *)((const char *)hdr + hdr->titlesets_offset);
+  const struct mkcat_disc * const discs =
+      (const struct mkcat_disc *)((const char *)hdr + hdr->discs_offset);
+  const char * const strings = (const char *)hdr + hdr->strings_offset;
+  uint64_t i;
+  if
+    (
+        !section_fits(hdr, hdr->titlesets_offset, hdr->numtitlesets, sizeof(struct mkcat_titleset))
+    ||
+        !section_fits(hdr, hdr->discs_offset, hdr->numdiscs, sizeof(struct mkcat_disc))
+    ||
+        !section_fits(hdr, hdr->chapters_offset, hdr->numtitles, sizeof(uint16_t))
+    ||
+        !section_fits(hdr, hdr->strings_offset, hdr->stringsize, 1)
+    ||
+        !section_fits(hdr, hdr->index_offset, hdr->numdiscs, sizeof(uint32_t))
+    ||
+        (hdr->stringsize != 0 && strings[hdr->stringsize - 1] != 0)
+    )
+    return false;
+  for (i = 0; i < hdr->numtitlesets; i++)
+    if
+      (
+          titlesets[i].disc >= hdr->numdiscs
+      ||
+          titlesets[i].numaudio > 8
+      ||
+          titlesets[i].numsubp > 32
+      )
+      return false;
+  for (i = 0; i < hdr->numdiscs; i++)
+    if (discs[i].name >= hdr->stringsize)
+      return false;
+  return true;
+} /*catalog_consistent*/
+
+const struct mkcat_header *catalog_map(const char *fname)
+/* maps an existing catalog into memory read-only, after checking that it is
+   one this version of mkinfo can read, and that it isn't truncated or damaged
+   in a way that would have catalog_query read outside it. */
+{
+  struct stat st;
+  const struct mkcat_header *hdr;
+  void *p;
+  const int fd = open(fname, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0)
+    {
+      fprintf(stderr, "ERR:  cannot open catalog %s: %s\n", fname, strerror(errno));
+      exit(1);
+    } /*if*/
+  if (st.st_size < (off_t)sizeof(struct mkcat_header))
+    {
+      fprintf(stderr, "ERR:  %s is not a catalog\n", fname);
+      exit(1);
+    } /*if*/
+  p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    {
+      fprintf(stderr, "ERR:  cannot map catalog %s: %s\n", fname, strerror(errno));
+      exit(1);
+    } /*if*/
+  hdr = p;
+  if
+    (
+        memcmp(hdr->magic, MKCAT_MAGIC, sizeof hdr->magic) != 0
+    ||
+        hdr->version != MKCAT_VERSION
+    ||
+        hdr->byteorder != MKCAT_BYTEORDER
+    ||
+        hdr->filesize != (uint64_t)st.st_size
+    )
+    {
+      fprintf(stderr, "ERR:  %s is not a version %d catalog for this machine\n", fname, MKCAT_VERSION);
+      exit(1);
+    } /*if*/
+  if (!catalog_consistent(hdr))
+    {
+      fprintf(stderr, "ERR:  catalog %s is damaged\n", fname);
+      exit(1);
+    } /*if*/
+  return hdr;
+} /*catalog_map*/
+
+void catalog_unmap(const struct mkcat_header *hdr)
+{
+  munmap((void *)hdr, hdr->filesize);
+} /*catalog_unmap*/
@@ -0,0 +1,96 @@
+/*
+    Format of the titleset catalog written by "mkinfo --catalog".
+
+    The catalog is a read-only file meant to be mmap'ed and used in place.
+    It starts with a struct mkcat_header; every other section is an array
+    of fixed-width records at the byte offset given in the header, aligned
+    to 8 bytes. All integers are in the byte order of the machine that wrote
+    the file, which consumers can verify via the byteorder field.
+
+      discs      struct mkcat_disc[numdiscs], in the order scanned
+      titlesets  struct mkcat_titleset[numtitlesets], grouped by disc
+      chapters   uint16_t[numtitles], number of chapters in each title,
+                 grouped by titleset
+      strings    NUL-terminated directory names
+      index      uint32_t[numdiscs], disc numbers sorted by strcmp order
+                 of their names, for binary search
+
+    Readers must reject files with an unknown magic or a version newer
+    than they understand; fields are only ever added in new versions.
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+#ifndef __MKINFO_CATALOG_H_
+#define __MKINFO_CATALOG_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MKCAT_MAGIC "MKINFOCT" /* 8 bytes, no terminating NUL in file */
+#define MKCAT_VERSION 1
+#define MKCAT_BYTEORDER 0x01020304
+
+struct mkcat_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder; /* MKCAT_BYTEORDER as written by the producer */
+    uint64_t filesize;
+    uint64_t numdiscs;
+    uint64_t numtitlesets;
+    uint64_t numtitles; /* entries in chapters section */
+    uint64_t stringsize; /* bytes in strings section */
+    uint64_t discs_offset;
+    uint64_t titlesets_offset;
+    uint64_t chapters_offset;
+    uint64_t strings_offset;
+    uint64_t index_offset;
+};
+
+struct mkcat_disc {
+    uint64_t name; /* offset of directory name in strings section */
+    uint32_t first_titleset; /* index of first titleset of this disc */
+    uint32_t numtitlesets;
+};
+
+struct mkcat_titleset {
+    uint32_t disc; /* index of containing disc */
+    uint32_t first_title; /* index into chapters section of first title */
+    uint32_t numsectors; /* size of titleset, including IFO and BUP */
+    uint16_t numtitles;
+    uint8_t vtsn; /* titleset number, nn in VTS_nn_0.IFO */
+    uint8_t hasmenu;
+    uint8_t vtscat[4]; /* VTS_CAT, as in the VTS IFO */
+    /* stream attributes, copied verbatim (big-endian, as on disc) from the VTS IFO */
+    uint8_t menu_video[2];
+    uint8_t title_video[2];
+    uint8_t numaudio;
+    uint8_t numsubp;
+    uint8_t pad0[2];
+    uint8_t audio[8][8];
+    uint8_t subp[32][6];
+    uint8_t pad1[4];
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,90 @@
+/*
+    mkinfo -- CRC-32C (Castagnoli), using the SSE 4.2 crc32 instruction where
+    the processor has it
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+#include "config.h"
+#include "compat.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mkinfo.h"
+#include "mi-internal.h"
+
+#define CRC32C_POLY 0x82f63b78 /* reversed */
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+  uint32_t i, j, c;
+  for (i = 0; i < 256; i++)
+    {
+      c = i;
+      for (j = 0; j < 8; j++)
+        c = c & 1 ? c >> 1 ^ CRC32C_POLY : c >> 1;
+      crc32c_table[i] = c;
+    } /*for*/
+} /*crc32c_init*/
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  pthread_once(&crc32c_table_once, crc32c_init);
+  while (len--)
+    crc = crc32c_table[(crc ^ *p++) & 255] ^ crc >> 8;
+  return crc;
+} /*crc32c_sw*/
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t c = crc;
+  for (; len && ((uintptr_t)p & 7); len--)
+    c = __builtin_ia32_crc32qi(c, *p++);
+  for (; len >= 8; len -= 8, p += 8)
+    {
+      uint64_t w;
+      memcpy(&w, p, 8);
+      c = __builtin_ia32_crc32di(c, w);
+    } /*for*/
+  for (; len; len--)
+    c = __builtin_ia32_crc32qi(c, *p++);
+  return c;
+} /*crc32c_hw*/
+
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+/* updates crc, initially 0, with len more bytes at buf. */
+{
+  crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (__builtin_cpu_supports("sse4.2"))
+    crc = crc32c_hw(crc, buf, len);
+  else
+#endif
+    crc = crc32c_sw(crc, buf, len);
+  return ~crc;
+} /*crc32c*/
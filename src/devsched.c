@@ -0,0 +1,406 @@
+/*
+    mkinfo -- handing out directories so that each storage device has only
+    so many being read at once
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+/*
+    Directories are read ahead from the source, up to DEVSCHED_LOOKAHEAD of
+    them, and queued by the device they are on, so that one can be given out
+    for whichever device has fewest in progress, rather than whichever comes
+    next. The device is found from st_dev, and for md and LVM volumes
+    followed down through the slaves directories in sysfs to the physical
+    disks; volumes sharing a disk share a queue.
+
+    Optionally, the directories in each queue are given out in the order of
+    where their first titleset IFO is on the disk, as found with FIEMAP,
+    sweeping across the disk and starting again from the beginning.
+*/
+
+#include "config.h"
+#include "compat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#include "mkinfo.h"
+
+#define DEVSCHED_LOOKAHEAD 1024 /* directories read ahead from the source */
+#define MAXDEPTH 8 /* of stacked devices, in case of loops */
+
+struct pending { /* a directory waiting to be given out */
+    char *name;
+    int dev; /* index into devs */
+    uint64_t key; /* disk position, or order of arrival */
+};
+
+struct devgroup { /* directories on devices sharing physical disks */
+    char **disks; /* names of the disks */
+    int numdisks;
+    struct pending *pending;
+    int numpending, maxpending;
+    int inflight; /* directories given out and not yet done */
+    uint64_t head; /* key of the last one given out */
+    unsigned long dispatched;
+    bool merged; /* absorbed into another group */
+};
+
+struct devinfo { /* a device seen as st_dev */
+    dev_t dev;
+    int group; /* index into groups */
+};
+
+struct inflight { /* a directory given out */
+    char *name;
+    int dev;
+};
+
+struct devsched {
+    int perdev; /* limit on inflight per group, 0 for none */
+    bool extent_order;
+    const char *(*source)(void *arg);
+    void *arg;
+    bool exhausted; /* source has no more */
+    struct devinfo *devs;
+    int numdevs;
+    struct devgroup *groups;
+    int numgroups;
+    struct inflight *inflight;
+    int numinflight, maxinflight;
+    int numpending; /* total in all groups */
+    int nextgroup; /* where to start looking, for taking turns */
+    uint64_t seq;
+    pthread_mutex_t lock;
+    pthread_cond_t done; /* signalled when a directory is done */
+};
+
+static void add_disk(char ***disks, int *numdisks, const char *name)
+{
+  int i;
+  for (i = 0; i < *numdisks; i++)
+    if (!strcmp((*disks)[i], name))
+      return;
+  *disks = realloc(*disks, (*numdisks + 1) * sizeof(char *));
+  (*disks)[(*numdisks)++] = strdup(name);
+} /*add_disk*/
+
+static void collect_disks(const char *sysdir, char ***disks, int *numdisks, int depth)
+/* adds the names of the physical disks making up the block device whose sysfs
+   directory is sysdir. */
+{
+  char path[PATH_MAX + 16], real[PATH_MAX];
+  struct dirent *de;
+  bool stacked = false;
+  DIR *d;
+
+  snprintf(path, sizeof path, "%s/slaves", sysdir);
+  d = depth < MAXDEPTH ? opendir(path) : 0;
+  if (d)
+    {
+      while ((de = readdir(d)) != 0)
+        {
+          if (de->d_name[0] == '.')
+            continue;
+          snprintf(path, sizeof path, "/sys/class/block/%s", de->d_name);
+          collect_disks(path, disks, numdisks, depth + 1);
+          stacked = true;
+        } /*while*/
+      closedir(d);
+    } /*if*/
+  if (stacked || !realpath(sysdir, real))
+    return;
+  snprintf(path, sizeof path, "%s/partition", real);
+  if (access(path, F_OK) == 0)
+    *strrchr(real, '/') = 0; /* the disk is the parent of the partition */
+  add_disk(disks, numdisks, strrchr(real, '/') + 1);
+} /*collect_disks*/
+
+static void merge_group(struct devsched *ds, int into, int from)
+/* moves everything in group from into group into. */
+{
+  struct devgroup * const g = &ds->groups[into], * const f = &ds->groups[from];
+  int i;
+  for (i = 0; i < f->numpending; i++)
+    {
+      if (g->numpending == g->maxpending)
+        {
+          g->maxpending = g->maxpending ? g->maxpending * 2 : 16;
+          g->pending = realloc(g->pending, g->maxpending * sizeof(struct pending));
+        } /*if*/
+      g->pending[g->numpending++] = f->pending[i];
+    } /*for*/
+  for (i = 0; i < f->numdisks; i++)
+    {
+      add_disk(&g->disks, &g->numdisks, f->disks[i]);
+      free(f->disks[i]);
+    } /*for*/
+  g->inflight += f->inflight;
+  g->dispatched += f->dispatched;
+  free(f->pending);
+  free(f->disks);
+  memset(f, 0, sizeof *f);
+  f->merged = true;
+  for (i = 0; i < ds->numdevs; i++)
+    if (ds->devs[i].group == from)
+      ds->devs[i].group = into;
+} /*merge_group*/
+
+static int find_dev(struct devsched *ds, dev_t dev)
+/* returns the index into ds->devs for dev, adding it if it hasn't been seen before. */
+{
+  char sysdir[64];
+  char **disks = 0;
+  int numdisks = 0, group = -1, i, j, k;
+
+  for (i = 0; i < ds->numdevs; i++)
+    if (ds->devs[i].dev == dev)
+      return i;
+  snprintf(sysdir, sizeof sysdir, "/sys/dev/block/%u:%u", major(dev), minor(dev));
+  if (access(sysdir, F_OK) == 0)
+    collect_disks(sysdir, &disks, &numdisks, 0);
+  if (!numdisks)
+    /* not a block device, e.g. NFS: just go by st_dev */
+    add_disk(&disks, &numdisks, sysdir + strlen("/sys/dev/block/"));
+  /* join all the groups already using any of the same disks */
+  for (i = 0; i < ds->numgroups; i++)
+    {
+      bool shared = false;
+      for (j = 0; j < ds->groups[i].numdisks && !shared; j++)
+        for (k = 0; k < numdisks && !shared; k++)
+          shared = !strcmp(ds->groups[i].disks[j], disks[k]);
+      if (!shared)
+        continue;
+      if (group < 0)
+        group = i;
+      else
+        merge_group(ds, group, i);
+    } /*for*/
+  if (group < 0)
+    {
+      ds->groups = realloc(ds->groups, (ds->numgroups + 1) * sizeof(struct devgroup));
+      group = ds->numgroups++;
+      memset(&ds->groups[group], 0, sizeof(struct devgroup));
+    } /*if*/
+  for (k = 0; k < numdisks; k++)
+    {
+      add_disk(&ds->groups[group].disks, &ds->groups[group].numdisks, disks[k]);
+      free(disks[k]);
+    } /*for*/
+  free(disks);
+  ds->devs = realloc(ds->devs, (ds->numdevs + 1) * sizeof(struct devinfo));
+  ds->devs[ds->numdevs].dev = dev;
+  ds->devs[ds->numdevs].group = group;
+  return ds->numdevs++;
+} /*find_dev*/
+
+static uint64_t disk_position(const char *dirname)
+/* returns where on its disk the first titleset IFO in dirname starts, or
+   UINT64_MAX if this can't be found out. */
+{
+  uint64_t result = UINT64_MAX;
+#ifdef FS_IOC_FIEMAP
+  static const char * const names[] = {"VIDEO_TS/VTS_01_0.IFO", "VIDEO_TS/vts_01_0.ifo"};
+  struct
+    {
+      struct fiemap map;
+      struct fiemap_extent extent;
+    } fm;
+  size_t i;
+  int dirfd = scan_openat(AT_FDCWD, dirname, O_RDONLY | O_DIRECTORY), fd = -1;
+  for (i = 0; dirfd >= 0 && fd < 0 && i < sizeof names / sizeof names[0]; i++)
+    fd = scan_openat(dirfd, names[i], O_RDONLY);
+  if (fd >= 0)
+    {
+      memset(&fm, 0, sizeof fm);
+      fm.map.fm_length = ~0ULL;
+      fm.map.fm_extent_count = 1;
+      if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0 && fm.map.fm_mapped_extents == 1)
+        result = fm.map.fm_extents[0].fe_physical;
+      close(fd);
+    } /*if*/
+  if (dirfd >= 0)
+    close(dirfd);
+#endif
+  return result;
+} /*disk_position*/
+
+static void fill(struct devsched *ds)
+/* reads ahead from the source, queueing each directory for its device. */
+{
+  while (!ds->exhausted && ds->numpending < DEVSCHED_LOOKAHEAD)
+    {
+      const char * const name = ds->source(ds->arg);
+      struct devgroup *g;
+      struct pending p;
+      struct stat st;
+      if (!name)
+        {
+          ds->exhausted = true;
+          break;
+        } /*if*/
+      p.name = strdup(name);
+      /* one that can't be looked at goes in a group of its own, to fail when its turn comes */
+      p.dev = find_dev(ds, stat(name, &st) == 0 ? st.st_dev : 0);
+      p.key = ds->extent_order ? disk_position(name) : ds->seq;
+      ds->seq++;
+      g = &ds->groups[ds->devs[p.dev].group];
+      if (g->numpending == g->maxpending)
+        {
+          g->maxpending = g->maxpending ? g->maxpending * 2 : 16;
+          g->pending = realloc(g->pending, g->maxpending * sizeof(struct pending));
+        } /*if*/
+      g->pending[g->numpending++] = p;
+      ds->numpending++;
+    } /*while*/
+} /*fill*/
+
+static const char *pick(struct devsched *ds)
+/* gives out a directory for a device that has room for another, if there are any. */
+{
+  int i, j;
+  for (i = 0; i < ds->numgroups; i++)
+    {
+      const int gi = (ds->nextgroup + i) % ds->numgroups;
+      struct devgroup * const g = &ds->groups[gi];
+      int best = -1, wrap = -1;
+      if (g->merged || !g->numpending || (ds->perdev && g->inflight >= ds->perdev))
+        continue;
+      for (j = 0; j < g->numpending; j++)
+        {
+          /* next one on from the head, or failing that, the lowest */
+          if (g->pending[j].key >= g->head && (best < 0 || g->pending[j].key < g->pending[best].key))
+            best = j;
+          if (wrap < 0 || g->pending[j].key < g->pending[wrap].key)
+            wrap = j;
+        } /*for*/
+      if (best < 0)
+        best = wrap;
+      if (ds->numinflight == ds->maxinflight)
+        {
+          ds->maxinflight = ds->maxinflight ? ds->maxinflight * 2 : 16;
+          ds->inflight = realloc(ds->inflight, ds->maxinflight * sizeof(struct inflight));
+        } /*if*/
+      ds->inflight[ds->numinflight].name = g->pending[best].name;
+      ds->inflight[ds->numinflight].dev = g->pending[best].dev;
+      g->head = g->pending[best].key;
+      g->pending[best] = g->pending[--g->numpending];
+      g->inflight++;
+      g->dispatched++;
+      ds->numpending--;
+      ds->nextgroup = gi + 1;
+      return ds->inflight[ds->numinflight++].name;
+    } /*for*/
+  return 0;
+} /*pick*/
+
+struct devsched *devsched_new(int perdev, bool extent_order, const char *(*source)(void *arg), void *arg)
+/* creates a scheduler giving out the directories returned by source (until it
+   returns NULL) with at most perdev in progress on any one device, if nonzero,
+   optionally in order of their position on the disk. */
+{
+  struct devsched * const ds = calloc(1, sizeof(struct devsched));
+  ds->perdev = perdev;
+  ds->extent_order = extent_order;
+  ds->source = source;
+  ds->arg = arg;
+  pthread_mutex_init(&ds->lock, 0);
+  pthread_cond_init(&ds->done, 0);
+  return ds;
+} /*devsched_new*/
+
+const char *devsched_next(struct devsched *ds, bool wait)
+/* returns the next directory to process, which stays valid until passed to
+   devsched_done. Returns NULL if there are no more, or if wait is false and
+   none can be given out until another is done. */
+{
+  const char *result;
+  pthread_mutex_lock(&ds->lock);
+  for (;;)
+    {
+      fill(ds);
+      result = pick(ds);
+      if (result || !ds->numpending || !wait)
+        break;
+      pthread_cond_wait(&ds->done, &ds->lock);
+    } /*for*/
+  pthread_mutex_unlock(&ds->lock);
+  return result;
+} /*devsched_next*/
+
+void devsched_done(struct devsched *ds, const char *dirname)
+/* notes that processing of dirname, as returned by devsched_next, is finished. */
+{
+  int i;
+  pthread_mutex_lock(&ds->lock);
+  for (i = 0; i < ds->numinflight; i++)
+    if (!strcmp(ds->inflight[i].name, dirname))
+      {
+        ds->groups[ds->devs[ds->inflight[i].dev].group].inflight--;
+        free(ds->inflight[i].name);
+        ds->inflight[i] = ds->inflight[--ds->numinflight];
+        pthread_cond_broadcast(&ds->done);
+        break;
+      } /*if; for*/
+  pthread_mutex_unlock(&ds->lock);
+} /*devsched_done*/
+
+void devsched_free(struct devsched *ds)
+/* reports how many directories there were on each device, and gets rid of ds. */
+{
+  int i, j;
+  for (i = 0; i < ds->numgroups; i++)
+    {
+      struct devgroup * const g = &ds->groups[i];
+      if (g->merged)
+        continue;
+      fprintf(stderr, "INFO: %lu directories on ", g->dispatched);
+      for (j = 0; j < g->numdisks; j++)
+        {
+          fprintf(stderr, "%s%s", j ? "+" : "", g->disks[j]);
+          free(g->disks[j]);
+        } /*for*/
+      fputc('\n', stderr);
+      for (j = 0; j < g->numpending; j++)
+        free(g->pending[j].name);
+      free(g->pending);
+      free(g->disks);
+    } /*for*/
+  for (i = 0; i < ds->numinflight; i++)
+    free(ds->inflight[i].name);
+  free(ds->inflight);
+  free(ds->groups);
+  free(ds->devs);
+  pthread_mutex_destroy(&ds->lock);
+  pthread_cond_destroy(&ds->done);
+  free(ds);
+} /*devsched_free*/
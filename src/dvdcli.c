@@ -20,61 +20,925 @@
  * USA
  */
 
+#include "config.h"
+#include "compat.h"
+
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(HAVE_MALLINFO2) || defined(HAVE_MALLINFO)
+#include <malloc.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
 
 #include "mkinfo.h"
-#include "compat.h"
 
-int default_video_format = VF_NONE;
+static int dir_timeout = 0; /* seconds allowed per directory, 0 for no limit */
+static int pipeline_threads[4]; /* for each stage, 0 if not using --pipeline */
+static int num_workers = 0; /* worker processes, 0 to do everything in this one */
+static int recycle_after = 100; /* jobs per worker process */
+static long soak_iterations = 0; /* for --soak, 0 for a normal run */
+static int per_device = 0; /* directories in progress per device, 0 for no limit */
+static bool extent_order = false; /* order directories on each device by disk position */
+static bool timing = false; /* report throughput and per-directory latency */
+
+static void usage(const char *progname);
 
 bool directory_has_ifo_file(const char* dirname)
 {
   DIR *d;
   struct dirent *de;
-  int len;
+  int len, fd;
   char* buffer;
 
   len = strlen(dirname);
   if (dirname[len-1] == '/') --len;
   buffer = malloc(len+10);
-  strncpy(buffer, dirname, len);
-  strcat(buffer, "/VIDEO_TS");
+  memcpy(buffer, dirname, len);
+  strcpy(buffer + len, "/VIDEO_TS");
 
-  d = opendir(buffer);
+  fd = scan_openat(AT_FDCWD, buffer, O_RDONLY | O_DIRECTORY);
+  d = fd >= 0 ? fdopendir(fd) : 0;
   free(buffer);
+  if (!d && fd >= 0)
+    close(fd);
+  if (!d)
+    return false;
+  io_delay(IO_READDIR);
   while ((de = readdir(d)) != 0)
     {
       if (strcasecmp(de->d_name, "VIDEO_TS.IFO") == 0) {
+        closedir(d);
         return true;
       }
     }
+  closedir(d);
   return false;
 }
 
-int main(int argc, char **argv)
+static char *mirror_path(const char *root, const char *dirname)
+/* returns the location under root corresponding to the absolute path of
+   dirname, e.g. /ssd + /archive/disc -> /ssd/archive/disc, or NULL if dirname
+   can't be resolved. */
+{
+  char real[PATH_MAX];
+  char *result;
+
+  if (!realpath(dirname, real))
+    {
+      fprintf(stderr, "ERR:  cannot resolve %s: %s\n", dirname, strerror(errno));
+      return 0;
+    }
+  result = malloc(strlen(root) + strlen(real) + 1);
+  strcpy(result, root);
+  strcat(result, real);
+  return result;
+}
+
+struct dirsource { /* where the names of the directories to process come from */
+    char **argv; /* remaining command-line arguments */
+    int argc;
+    FILE *list; /* or a file listing them one per line, if non-NULL */
+    char *line;
+    size_t linesize;
+};
+
+static const char *next_directory(struct dirsource *src)
+/* returns the name of the next directory to process, or NULL if there are no more. */
+{
+  ssize_t len;
+  if (!src->list)
+    {
+      if (!src->argc)
+        return 0;
+      src->argc--;
+      return *src->argv++;
+    }
+  while ((len = getline(&src->line, &src->linesize, src->list)) > 0)
+    {
+      if (src->line[len - 1] == '\n')
+        src->line[--len] = 0;
+      if (len)
+        return src->line;
+    }
+  return 0;
+}
+
+struct sweep { /* what all the stages of processing a directory need to know */
+    const char *outroot;
+    struct catalog *cat;
+    struct journal *journal;
+    struct dirsource *src;
+    struct devsched *sched; /* if handing out directories by device */
+    int numdirs, numbad;
+    double *times; /* for --timing, how long each directory took */
+    size_t numtimes, maxtimes;
+    struct hedge_stats hedge; /* for --hedge, as done in worker processes */
+};
+
+struct dirjob { /* a directory being processed */
+    char *dirname;
+    char *outbase; /* where to put the VMG, if not in dirname */
+    enum journal_status status;
+    bool generate; /* whether the VMG needs generating */
+    struct toc_summary *ts;
+    struct vmg_image *img;
+    unsigned int outcrc; /* CRC-32C of the generated VIDEO_TS.IFO, if any */
+    double started; /* monotime when processing began, 0 if it didn't */
+    double elapsed; /* time taken, if known before it is finished */
+};
+
+static struct dirjob *dirjob_new(const char *dirname)
+{
+  struct dirjob * const job = calloc(1, sizeof(struct dirjob));
+  job->dirname = strdup(dirname);
+  return job;
+}
+
+static void dirjob_free(struct dirjob *job)
+{
+  vmg_image_free(job->img);
+  toc_summary_free(job->ts);
+  free(job->outbase);
+  free(job->dirname);
+  free(job);
+}
+
+static void stage_classify(void *p, void *arg)
+/* decides whether the directory needs a VMG. */
+{
+  struct dirjob * const job = p;
+  const struct sweep * const sw = arg;
+  job->started = monotime();
+  fprintf(stdout, "Checking directory %s\n", job->dirname);
+  if (sw->journal && journal_finished(sw->journal, job->dirname)) {
+    /* only here for the catalog */
+    fprintf(stdout, "Already finished according to the journal.  Doing nothing\n");
+    job->status = JOURNAL_SKIP;
+    return;
+  }
+  if (sw->outroot && !(job->outbase = mirror_path(sw->outroot, job->dirname))) {
+    job->status = JOURNAL_FAIL;
+    return;
+  }
+  switch (vmg_stamp_check(job->dirname, job->outbase)) {
+  case VMG_STAMP_CURRENT:
+    fprintf(stdout, "VIDEO_TS.IFO up to date.  Doing nothing\n");
+    job->status = JOURNAL_SKIP;
+    return;
+  case VMG_STAMP_STALE:
+    /* ours to replace, unless an original has turned up in the source since */
+    if (!job->outbase || !directory_has_ifo_file(job->dirname)) {
+      fprintf(stdout, "VIDEO_TS.IFO out of date.  Regenerating\n");
+      job->generate = true;
+      return;
+    }
+    break;
+  case VMG_STAMP_NONE:
+    break;
+  }
+  if (directory_has_ifo_file(job->dirname)
+      || (job->outbase && directory_has_ifo_file(job->outbase))) {
+    fprintf(stdout, "VIDEO_TS.IFO already present.  Doing nothing\n");
+    job->status = JOURNAL_SKIP;
+  } else {
+    fprintf(stdout, "Processing directory\n");
+    job->generate = true;
+  }
+}
+
+static void stage_scan(void *p, void *arg)
+/* reads the headers of the titlesets, if they are needed for the VMG or the catalog. */
+{
+  struct dirjob * const job = p;
+  const struct sweep * const sw = arg;
+  if (job->generate || sw->cat) {
+    job->ts = toc_summary_scan(job->dirname);
+    if (!job->ts) {
+      job->status = JOURNAL_FAIL;
+      job->generate = false;
+    }
+  }
+}
+
+static void stage_layout(void *p, void *arg)
+/* lays out the VMG in memory, if needed. */
 {
+  struct dirjob * const job = p;
   struct pgcgroup *va[1]; /* element 0 for doing menus, 1 for doing titles */
   struct menugroup *mg;
-
+  if (!job->generate)
+    return;
   /* Menus set to some default setup */
   memset(va, 0, sizeof(struct pgcgroup *));
   va[0] = pgcgroup_new(VTYPE_VTSM);
   mg = menugroup_new();
   menugroup_add_pgcgroup(mg, "en", va[0]);
+  job->img = dvdauthor_vmgm_layout(mg, job->ts);
+  menugroup_free(mg);
+}
 
-  if (argc==2) {
-    fprintf(stdout, "Checking directory %s\n", argv[1]);
-    if (directory_has_ifo_file(argv[1])) {
-      fprintf(stdout, "VIDEO_TS.IFO already present.  Doing nothing\n");
-    } else {
-      fprintf(stdout, "Processing directory\n");
-      dvdauthor_vmgm_gen(mg, argv[1]);
-    }
+static void stage_write(void *p, void *arg)
+/* writes out the VMG, if needed. */
+{
+  struct dirjob * const job = p;
+  const struct sweep * const sw = arg;
+  if (job->img) {
+    job->status =
+        dvdauthor_vmgm_write(job->img, job->outbase ? job->outbase : job->dirname, &job->outcrc)
+      ?
+        JOURNAL_DONE
+      :
+        JOURNAL_FAIL;
+    if (job->status == JOURNAL_DONE)
+      vmg_stamp_set(job->dirname, job->outbase, job->outcrc);
+    vmg_image_free(job->img);
+    job->img = 0;
+  }
+  if (!sw->cat) {
+    toc_summary_free(job->ts); /* no further use */
+    job->ts = 0;
+  }
+}
+
+static const struct pipeline_stage stages[] =
+  { /* processing of a directory, in order; the numbers of threads are filled in
+       from the --pipeline option */
+    {"classify", 1, stage_classify},
+    {"scan", 1, stage_scan},
+    {"layout", 1, stage_layout},
+    {"write", 1, stage_write},
+  };
+#define NUMSTAGES (sizeof stages / sizeof stages[0])
+
+static void run_stages(struct dirjob *job, struct sweep *sw)
+/* does all the processing of a directory, in this thread. */
+{
+  size_t i;
+  for (i = 0; i < NUMSTAGES; i++)
+    stages[i].process(job, sw);
+}
+
+struct jobresult { /* sent back by a worker, followed by the packed toc_summary, if any */
+    enum journal_status status;
+    unsigned int outcrc;
+    double elapsed;
+    struct hedge_stats hedge; /* done for this job */
+};
+
+static void *do_job(const char *dirname, size_t *len, void *arg)
+/* processes a directory in a worker process, returning the outcome as a
+   struct jobresult and packed toc_summary. */
+{
+  struct dirjob * const job = dirjob_new(dirname);
+  struct sweep * const sw = arg;
+  struct jobresult res;
+  struct hedge_stats before;
+  void *packed = 0;
+  size_t packedlen = 0;
+  unsigned char *result;
+  if (sw->src->list && fileno(sw->src->list) >= 0) {
+    /* The worker shares the file offset of the directory list with the supervisor,
+       and exit() would move it back to where this process's copy of the stream
+       has got to. Make that harmless. */
+    const int nullfd = open("/dev/null", O_RDONLY);
+    dup2(nullfd, fileno(sw->src->list));
+    close(nullfd);
+  }
+  hedge_stats_get(&before);
+  run_stages(job, sw);
+  hedge_stats_get(&res.hedge);
+  res.hedge.reads -= before.reads;
+  res.hedge.hedged -= before.hedged;
+  res.hedge.won -= before.won;
+  res.status = job->status;
+  res.outcrc = job->outcrc;
+  res.elapsed = monotime() - job->started;
+  if (job->ts)
+    packed = toc_summary_pack(job->ts, &packedlen);
+  *len = sizeof res + packedlen;
+  result = malloc(*len);
+  memcpy(result, &res, sizeof res);
+  if (packedlen)
+    memcpy(result + sizeof res, packed, packedlen);
+  free(packed);
+  dirjob_free(job);
+  return result;
+}
+
+static void finish_job(void *p, void *arg);
+
+static void job_done(const char *dirname, const void *result, size_t len, enum pool_outcome outcome, void *arg)
+/* records the outcome of processing a directory in a worker process. */
+{
+  struct dirjob * const job = dirjob_new(dirname);
+  struct sweep * const sw = arg;
+  struct jobresult res;
+  if (outcome == POOL_TIMEDOUT) {
+    job->status = JOURNAL_TIMEOUT;
+    job->elapsed = dir_timeout;
+  } else if (outcome != POOL_DONE || len < sizeof res) {
+    job->status = JOURNAL_FAIL;
   } else {
-    fprintf(stderr, "Usage foobar /path/to/dvddirectory\n");
+    memcpy(&res, result, sizeof res);
+    job->status = res.status;
+    job->outcrc = res.outcrc;
+    job->elapsed = res.elapsed;
+    sw->hedge.reads += res.hedge.reads;
+    sw->hedge.hedged += res.hedge.hedged;
+    sw->hedge.won += res.hedge.won;
+    if (len > sizeof res) {
+      job->ts = toc_summary_unpack((const char *)result + sizeof res, len - sizeof res);
+      if (!job->ts) {
+        fprintf(stderr, "ERR:  %s: garbled result from worker\n", dirname);
+        job->status = JOURNAL_FAIL;
+      }
+    }
+  }
+  finish_job(job, arg);
+}
+
+static void remove_tmp_files(const char *base, bool titlesets)
+/* removes whatever temporary files a job may have left in base/VIDEO_TS: those for
+   the VMG, and if titlesets, those for IFOs being restored from their BUPs. */
+{
+  char * const vtsdir = malloc(strlen(base) + 10);
+  DIR *d;
+  struct dirent *de;
+  int dirfd;
+  sprintf(vtsdir, "%s/VIDEO_TS", base);
+  dirfd = open(vtsdir, O_RDONLY | O_DIRECTORY);
+  free(vtsdir);
+  if (dirfd < 0)
+    return;
+  unlinkat(dirfd, "VIDEO_TS.IFO.tmp", 0);
+  unlinkat(dirfd, "VIDEO_TS.BUP.tmp", 0);
+  if (titlesets && (d = fdopendir(dup(dirfd))) != 0) {
+    while ((de = readdir(d)) != 0) {
+      const size_t len = strlen(de->d_name);
+      if (len > 8 && !strncasecmp(de->d_name, "VTS_", 4) && !strcmp(de->d_name + len - 4, ".tmp"))
+        unlinkat(dirfd, de->d_name, 0);
+    }
+    closedir(d);
+  }
+  close(dirfd);
+}
+
+static void abandon_job(const char *dirname, void *arg)
+/* cleans up after a worker killed while processing dirname, so that no partial
+   output is left behind. Runs in a process of its own. */
+{
+  const struct sweep * const sw = arg;
+  if (sw->outroot) {
+    char * const outbase = mirror_path(sw->outroot, dirname);
+    if (outbase)
+      remove_tmp_files(outbase, false);
+    free(outbase);
+  }
+  if (!sw->outroot || repair_ifo)
+    remove_tmp_files(dirname, repair_ifo);
+}
+
+static const char *next_dirname(struct sweep *sw)
+/* returns the next directory that needs looking at, or NULL if there are no more.
+   Those the journal says are finished still need scanning for the catalog, which
+   is built afresh each time. */
+{
+  const char *dirname;
+  while ((dirname = next_directory(sw->src)) != 0) {
+    sw->numdirs++;
+    if (!sw->journal || sw->cat || !journal_finished(sw->journal, dirname))
+      return dirname;
   }
   return 0;
 }
+
+static const char *next_source(void *arg)
+/* where the device scheduler gets its directories from. */
+{
+  return next_dirname(arg);
+}
+
+static const char *next_request(void *arg)
+{
+  struct sweep * const sw = arg;
+  return sw->sched ? devsched_next(sw->sched, false) : next_dirname(sw);
+}
+
+static void *next_job(void *arg)
+{
+  struct sweep * const sw = arg;
+  const char * const dirname = sw->sched ? devsched_next(sw->sched, true) : next_dirname(sw);
+  return dirname ? dirjob_new(dirname) : 0;
+}
+
+static void finish_job(void *p, void *arg)
+/* records the outcome of processing a directory. */
+{
+  struct dirjob * const job = p;
+  struct sweep * const sw = arg;
+  if (job->status == JOURNAL_FAIL || job->status == JOURNAL_TIMEOUT)
+    sw->numbad++;
+  if (sw->cat && job->ts && (job->status == JOURNAL_DONE || job->status == JOURNAL_SKIP))
+    catalog_add(sw->cat, job->dirname, job->ts);
+  if (sw->journal && !journal_finished(sw->journal, job->dirname))
+    journal_record(sw->journal, job->dirname, job->status, job->outcrc);
+  if (sw->sched)
+    devsched_done(sw->sched, job->dirname);
+  if (timing && (job->started || job->elapsed)) {
+    if (sw->numtimes == sw->maxtimes) {
+      sw->maxtimes = sw->maxtimes ? sw->maxtimes * 2 : 1024;
+      sw->times = realloc(sw->times, sw->maxtimes * sizeof(double));
+    }
+    sw->times[sw->numtimes++] = job->elapsed ? job->elapsed : monotime() - job->started;
+  }
+  dirjob_free(job);
+}
+
+static int compare_times(const void *a, const void *b)
+{
+  const double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, size_t n, int p)
+/* the smallest of the n sorted values not exceeded by more than p% of them. */
+{
+  const size_t i = (n * p + 99) / 100;
+  return sorted[i ? i - 1 : 0];
+}
+
+static void report_hedging(const struct sweep *sw)
+/* for --hedge. */
+{
+  struct hedge_stats stats;
+  hedge_stats_get(&stats);
+  fprintf
+    (
+      stderr,
+      "INFO: hedge: %lu of %lu VTS IFO reads also tried the BUP, which was used for %lu\n",
+      stats.hedged + sw->hedge.hedged, stats.reads + sw->hedge.reads, stats.won + sw->hedge.won
+    );
+}
+
+static void report_timing(struct sweep *sw, double elapsed)
+/* for --timing. */
+{
+  if (!sw->numtimes) {
+    fprintf(stderr, "INFO: timing: no directories processed in %.2f s\n", elapsed);
+    return;
+  }
+  qsort(sw->times, sw->numtimes, sizeof(double), compare_times);
+  fprintf
+    (
+      stderr,
+      "INFO: timing: %lu directories in %.2f s, %.1f/s; per directory p50 %.1f ms,"
+        " p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+      (unsigned long)sw->numtimes, elapsed, elapsed > 0 ? sw->numtimes / elapsed : 0.0,
+      percentile(sw->times, sw->numtimes, 50) * 1000, percentile(sw->times, sw->numtimes, 90) * 1000,
+      percentile(sw->times, sw->numtimes, 99) * 1000, sw->times[sw->numtimes - 1] * 1000
+    );
+}
+
+struct resources { /* what the process has in use, for --soak */
+    int fds; /* open descriptors, -1 if unknown */
+    long rsskb; /* resident set size, -1 if unknown */
+    long heap; /* bytes allocated with malloc, -1 if unknown */
+};
+
+static void measure_resources(struct resources *r)
+{
+  DIR *d;
+  FILE *statm;
+  long pages;
+  r->fds = -1;
+  d = opendir("/proc/self/fd");
+  if (d) {
+    r->fds = -3; /* not counting ., .. or d itself */
+    while (readdir(d) != 0)
+      r->fds++;
+    closedir(d);
+  }
+  r->rsskb = -1;
+  statm = fopen("/proc/self/statm", "r");
+  if (statm) {
+    if (fscanf(statm, "%*d %ld", &pages) == 1)
+      r->rsskb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    fclose(statm);
+  }
+#if defined(HAVE_MALLINFO2)
+  {
+    const struct mallinfo2 mi = mallinfo2();
+    r->heap = mi.uordblks + mi.hblkhd;
+  }
+#elif defined(HAVE_MALLINFO)
+  {
+    const struct mallinfo mi = mallinfo();
+    r->heap = (unsigned int)mi.uordblks + (unsigned int)mi.hblkhd;
+  }
+#else
+  r->heap = -1;
+#endif
+}
+
+#define SOAK_WARMUP_PASSES 8
+  /* passes over the directories before resource use should settle: the allocator
+     keeps some freed memory cached, counted as in use until that fills up (e.g.
+     glibc's tcache holds up to 7 chunks of each size) */
+
+static int soak(struct sweep *sw, long iterations)
+/* generates the VMGs of the directories given over and over, iterations times
+   in all, keeping track of the resources in use. Once SOAK_WARMUP_PASSES passes
+   over the directories have got everything warmed up, any growth in descriptors
+   or heap by the end counts as a leak; there must be iterations left to measure
+   after that. Returns the exit status. */
+{
+  struct resources base, now, peak;
+  char **dirs = 0;
+  const char *dirname;
+  int numdirs = 0, maxdirs = 0, failures = 0;
+  long i, warmup, interval;
+  bool grew;
+
+  while ((dirname = next_directory(sw->src)) != 0) {
+    if (numdirs == maxdirs) {
+      maxdirs = maxdirs ? maxdirs * 2 : 64;
+      dirs = realloc(dirs, maxdirs * sizeof(char *));
+    }
+    dirs[numdirs++] = strdup(dirname);
+  }
+  if (!numdirs) {
+    fprintf(stderr, "ERR:  no directories to soak with\n");
+    return 1;
+  }
+  warmup = (long)numdirs * SOAK_WARMUP_PASSES;
+  if (iterations <= warmup) {
+    fprintf
+      (
+        stderr,
+        "ERR:  --soak=%ld leaves nothing to measure after warming up with %ld iterations;"
+          " give more than that\n",
+        iterations, warmup
+      );
+    for (i = 0; i < numdirs; i++)
+      free(dirs[i]);
+    free(dirs);
+    return 1;
+  }
+  interval = iterations >= 10 ? iterations / 10 : 1;
+  /* first output allocates the stdout buffer, which mustn't look like a leak */
+  printf("soak: %ld iterations over %d directories\n", iterations, numdirs);
+  memset(&base, 0, sizeof base);
+  memset(&now, 0, sizeof now);
+  for (i = 0; i < iterations; i++) {
+    struct dirjob * const job = dirjob_new(dirs[i % numdirs]);
+    size_t j;
+    job->generate = true; /* whether or not it's there from last time round */
+    if (sw->outroot && !(job->outbase = mirror_path(sw->outroot, job->dirname)))
+      job->status = JOURNAL_FAIL;
+    else
+      for (j = 1; j < NUMSTAGES; j++) /* all but classify */
+        stages[j].process(job, sw);
+    if (job->status != JOURNAL_DONE)
+      failures++;
+    dirjob_free(job);
+    measure_resources(&now);
+    if (i + 1 == warmup)
+      base = peak = now;
+    else if (i + 1 > warmup) {
+      if (now.fds > peak.fds)
+        peak.fds = now.fds;
+      if (now.rsskb > peak.rsskb)
+        peak.rsskb = now.rsskb;
+      if (now.heap > peak.heap)
+        peak.heap = now.heap;
+    }
+    if ((i + 1) % interval == 0 || i + 1 == iterations)
+      printf("soak %ld: %d fds, %ld kB resident, %ld bytes allocated\n", i + 1, now.fds, now.rsskb, now.heap);
+  }
+  for (i = 0; i < numdirs; i++)
+    free(dirs[i]);
+  free(dirs);
+  grew = now.fds > base.fds || now.heap > base.heap;
+  fprintf
+    (
+      stderr,
+      "%s soak: after warming up with %ld iterations: %d -> %d fds (peak %d), %ld -> %ld kB resident"
+        " (peak %ld), %ld -> %ld bytes allocated (peak %ld)\n",
+      grew ? "ERR: " : "INFO:", warmup, base.fds, now.fds, peak.fds,
+      base.rsskb, now.rsskb, peak.rsskb, base.heap, now.heap, peak.heap
+    );
+  if (failures)
+    fprintf(stderr, "WARN: %d of %ld iterations failed\n", failures, iterations);
+  return grew || failures ? 1 : 0;
+}
+
+static void parse_pipeline(const char *s, const char *progname)
+/* sets the numbers of threads for each stage from a comma-separated list. */
+{
+  size_t i;
+  for (i = 0; i < NUMSTAGES; i++) {
+    char *end;
+    const long n = strtol(s, &end, 10);
+    if (n < 1 || n > 256 || (*end != ',' && *end != 0) || (*end == 0) != (i + 1 == NUMSTAGES))
+      usage(progname);
+    pipeline_threads[i] = n;
+    s = end + 1;
+  }
+}
+
+static void usage(const char *progname)
+{
+  fprintf
+    (
+      stderr,
+      "Usage: %s [options] /path/to/dvddirectory...\n"
+      "       %s [options] --dir-list=FILE\n"
+      "\n"
+      "  -f, --dir-list=FILE    read the names of the DVD directories from FILE, one per\n"
+      "                         line, instead of the command line (- for stdin)\n"
+      "  -j, --journal=FILE     record each directory dealt with in FILE, and skip any\n"
+      "                         already recorded as finished there by an earlier run\n"
+      "  -t, --timeout=SECONDS  give up on any directory not finished within SECONDS,\n"
+      "                         e.g. because its server has stopped responding (implies\n"
+      "                         --workers=1 unless given)\n"
+      "  -P, --pipeline=C,S,L,W process several directories at once, in a pipeline of\n"
+      "                         stages with C threads classifying directories, S reading\n"
+      "                         titleset headers, L laying out VMGs and W writing them\n"
+      "      --queue-depth=N    let at most N directories wait for each stage (default 16)\n"
+      "      --metrics=SECONDS  report the pipeline queue depths every SECONDS\n"
+      "  -w, --workers=N        process directories in a pool of N worker processes, so\n"
+      "                         that a crash on a bad disc fails only that directory\n"
+      "      --recycle=N        replace each worker after N directories (default 100,\n"
+      "                         0 for never)\n"
+      "      --per-device=N     have at most N directories in progress on any one\n"
+      "                         storage device at once, taking turns between devices\n"
+      "      --extent-order     take the directories on each device in order of where\n"
+      "                         their titlesets are on the disk\n"
+      "      --io-latency=PROFILE\n"
+      "                         slow down every open, directory listing, read, write\n"
+      "                         and sync of the storage as PROFILE says, e.g. wan-nfs\n"
+      "                         or delay=5,jitter=2,stall=0.1@2000 (see README;\n"
+      "                         implies --timing)\n"
+      "      --timing           report throughput and per-directory latency\n"
+      "      --soak=N           generate VMGs for the directories given over and over,\n"
+      "                         N times in all, and fail if descriptors or heap in use\n"
+      "                         grow once warmed up\n"
+      "  -o, --output-root=DIR  read titlesets from the DVD directory, but write\n"
+      "                         VIDEO_TS.IFO/BUP under DIR at the same path, leaving\n"
+      "                         the source tree untouched\n"
+      "  -c, --catalog=FILE     also scan every directory given, including complete\n"
+      "                         ones, and write a binary catalog of their titlesets\n"
+      "  -q, --query=TERMS      instead of scanning, list the titlesets in the catalog\n"
+      "                         matching all the comma-separated TERMS, each of which\n"
+      "                         is an attribute keyword (e.g. pal, 16:9, dts, 6ch),\n"
+      "                         alang=xx or slang=xx, optionally preceded by ! to negate\n"
+      "      --scan-io=MODE     how to read existing files: cached (the default), drop\n"
+      "                         (leave the page cache and access times as they were)\n"
+      "                         or direct (as drop, but bypass the page cache)\n"
+      "      --hedge=PERCENTILE if reading a VTS IFO takes longer than PERCENTILE percent\n"
+      "                         of recent ones did, read its BUP as well and use\n"
+      "                         whichever comes back intact first\n"
+      "  -r, --repair           when a damaged VTS IFO is replaced by its BUP, also\n"
+      "                         overwrite the IFO with a copy of the BUP (this writes\n"
+      "                         to the source tree, even with --output-root)\n"
+      "  -a, --audit            instead of generating anything, check that every VTS IFO\n"
+      "                         matches its BUP and the size of its titleset, and\n"
+      "                         print a CRC-32C of each\n",
+      progname, progname
+    );
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option longopts[] =
+    {
+      {"output-root", 1, 0, 'o'},
+      {"catalog", 1, 0, 'c'},
+      {"query", 1, 0, 'q'},
+      {"audit", 0, 0, 'a'},
+      {"repair", 0, 0, 'r'},
+      {"dir-list", 1, 0, 'f'},
+      {"journal", 1, 0, 'j'},
+      {"timeout", 1, 0, 't'},
+      {"pipeline", 1, 0, 'P'},
+      {"queue-depth", 1, 0, 'Q'},
+      {"metrics", 1, 0, 'M'},
+      {"workers", 1, 0, 'w'},
+      {"recycle", 1, 0, 'R'},
+      {"scan-io", 1, 0, 'I'},
+      {"soak", 1, 0, 'S'},
+      {"per-device", 1, 0, 'D'},
+      {"extent-order", 0, 0, 'E'},
+      {"io-latency", 1, 0, 'L'},
+      {"timing", 0, 0, 'T'},
+      {"hedge", 1, 0, 'H'},
+      {"help", 0, 0, 'h'},
+      {0, 0, 0, 0}
+    };
+  const char *catname = 0, *query = 0, *listname = 0, *journalname = 0;
+  const char *dirname;
+  struct sweep sw;
+  struct dirsource src;
+  bool audit = false;
+  int c, queue_depth = 16, metrics_interval = 0;
+  double started;
+
+  memset(&sw, 0, sizeof sw);
+  while ((c = getopt_long(argc, argv, "o:c:q:arf:j:t:P:w:h", longopts, NULL)) != -1)
+    switch (c)
+      {
+      case 'o':
+        sw.outroot = optarg;
+        break;
+      case 'c':
+        catname = optarg;
+        break;
+      case 'q':
+        query = optarg;
+        break;
+      case 'a':
+        audit = true;
+        break;
+      case 'r':
+        repair_ifo = true;
+        break;
+      case 'f':
+        listname = optarg;
+        break;
+      case 'j':
+        journalname = optarg;
+        break;
+      case 't':
+        dir_timeout = strtol(optarg, 0, 10);
+        if (dir_timeout <= 0)
+          usage(argv[0]);
+        break;
+      case 'P':
+        parse_pipeline(optarg, argv[0]);
+        break;
+      case 'Q':
+        queue_depth = strtol(optarg, 0, 10);
+        if (queue_depth < 1)
+          usage(argv[0]);
+        break;
+      case 'w':
+        num_workers = strtol(optarg, 0, 10);
+        if (num_workers < 1)
+          usage(argv[0]);
+        break;
+      case 'R':
+        recycle_after = strtol(optarg, 0, 10);
+        if (recycle_after < 0)
+          usage(argv[0]);
+        break;
+      case 'I':
+        if (!strcmp(optarg, "cached"))
+          scan_io = SCAN_IO_CACHED;
+        else if (!strcmp(optarg, "drop"))
+          scan_io = SCAN_IO_DROP;
+        else if (!strcmp(optarg, "direct"))
+          scan_io = SCAN_IO_DIRECT;
+        else
+          usage(argv[0]);
+        break;
+      case 'S':
+        soak_iterations = strtol(optarg, 0, 10);
+        if (soak_iterations < 1)
+          usage(argv[0]);
+        break;
+      case 'D':
+        per_device = strtol(optarg, 0, 10);
+        if (per_device < 1)
+          usage(argv[0]);
+        break;
+      case 'E':
+        extent_order = true;
+        break;
+      case 'L':
+        if (!io_latency_parse(optarg))
+          {
+            fprintf(stderr, "ERR:  cannot make sense of --io-latency=%s\n", optarg);
+            return 1;
+          }
+        timing = true;
+        break;
+      case 'T':
+        timing = true;
+        break;
+      case 'H':
+        hedge_percentile = strtol(optarg, 0, 10);
+        if (hedge_percentile < 1 || hedge_percentile > 99)
+          usage(argv[0]);
+        break;
+      case 'M':
+        metrics_interval = strtol(optarg, 0, 10);
+        if (metrics_interval < 1)
+          usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+      }
+  if (query)
+    {
+      if (!catname || optind != argc)
+        usage(argv[0]);
+      return catalog_query(catname, query) ? 0 : 1;
+    }
+  if ((dir_timeout || num_workers) && pipeline_threads[0])
+    {
+      fprintf(stderr, "ERR:  --timeout and --workers cannot be used with --pipeline\n");
+      return 1;
+    }
+  if (soak_iterations && (dir_timeout || num_workers || pipeline_threads[0] || catname || journalname || audit))
+    {
+      fprintf(stderr, "ERR:  --soak cannot be used with --timeout, --workers, --pipeline, --catalog, --journal or --audit\n");
+      return 1;
+    }
+  if (dir_timeout && !num_workers)
+    num_workers = 1;
+  memset(&src, 0, sizeof src);
+  if (listname)
+    {
+      if (optind != argc)
+        usage(argv[0]);
+      src.list = strcmp(listname, "-") ? fopen(listname, "r") : stdin;
+      if (!src.list)
+        {
+          fprintf(stderr, "ERR:  cannot open %s: %s\n", listname, strerror(errno));
+          return 1;
+        }
+    }
+  else if (optind == argc)
+    usage(argv[0]);
+  src.argv = argv + optind;
+  src.argc = argc - optind;
+  sw.src = &src;
+
+  if (audit)
+    {
+      while ((dirname = next_directory(&src)) != 0)
+        {
+          sw.numdirs++;
+          if (audit_directory(dirname) != 0)
+            sw.numbad++;
+        }
+      fprintf(stderr, "INFO: %d of %d directories damaged\n", sw.numbad, sw.numdirs);
+      return sw.numbad ? 2 : 0;
+    }
+  if (soak_iterations)
+    return soak(&sw, soak_iterations);
+  if (catname)
+    sw.cat = catalog_create(catname);
+  if (journalname)
+    sw.journal = journal_open(journalname);
+  if (per_device || extent_order)
+    sw.sched = devsched_new(per_device, extent_order, next_source, &sw);
+  started = monotime();
+
+  if (pipeline_threads[0])
+    {
+      struct pipeline_stage pstages[NUMSTAGES];
+      size_t i;
+      for (i = 0; i < NUMSTAGES; i++)
+        {
+          pstages[i] = stages[i];
+          pstages[i].numthreads = pipeline_threads[i];
+        }
+      pipeline_run(pstages, NUMSTAGES, queue_depth, metrics_interval, next_job, finish_job, &sw);
+    }
+  else if (num_workers)
+    pool_run(num_workers, recycle_after, dir_timeout, next_request, do_job, job_done, abandon_job, &sw);
+  else
+    {
+      struct dirjob *job;
+      while ((job = next_job(&sw)) != 0)
+        {
+          run_stages(job, &sw);
+          finish_job(job, &sw);
+        }
+    }
+  if (hedge_percentile)
+    report_hedging(&sw);
+  if (timing)
+    report_timing(&sw, monotime() - started);
+  free(sw.times);
+  if (sw.sched)
+    devsched_free(sw.sched);
+  if (sw.journal)
+    journal_close(sw.journal);
+  if (sw.cat)
+    catalog_finish(sw.cat);
+  if (sw.numbad)
+    fprintf(stderr, "WARN: %d of %d directories failed\n", sw.numbad, sw.numdirs);
+  return sw.numbad ? 1 : 0;
+}
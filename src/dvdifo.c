@@ -24,231 +24,274 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* the minimum POSIX allows is 16, but Linux has always had 1024 */
+#endif
 
 #include "config.h"
 #include "compat.h"
 
 #include "mkinfo.h"
 #include "mi-internal.h"
+#include "ifo-layout.h"
 
-static unsigned char *
-bigbuf = 0;
-static size_t
-bigbufsize = 0;
-
-static void buf_init()
-/* ensures there's no leftover junk in bigbuf. */
+static bool write_iov(int fd, struct iovec *iov, int iovcnt, const char *fname)
+/* writes the pieces described by iov to fd in a single writev call (more if the
+   kernel writes only part of them), instead of copying them together first.
+   The contents of iov are clobbered. Returns false if they couldn't all be
+   written. */
 {
-  free(bigbuf);
-  bigbuf = 0;
-  bigbufsize = 0;
-} /*buf_init*/
-
-static void buf_need(size_t sizeneeded)
-/* ensures that bigbuf is at least sizeneeded bytes in size. */
-{
-  if (sizeneeded > bigbufsize)
+  size_t total = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  while (iovcnt > 0 && total > 0)
     {
-      const size_t newbufsize = (sizeneeded + 2047) / 2048 * 2048; /* allocate next whole sector */
-      // fprintf(stderr, "INFO: need_buf: bigbufsize now %ld sectors.\n", newbufsize / 2048);
-      bigbuf = realloc(bigbuf, newbufsize);
-      if (bigbuf == 0)
+      size_t done;
+      ssize_t n;
+      io_delay(IO_WRITE);
+      n = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      total -= n;
+      for (done = n; iovcnt > 0 && done >= iov->iov_len; iov++, iovcnt--)
+        done -= iov->iov_len; /* skip pieces completely written */
+      if (iovcnt > 0)
         {
-          fprintf(stderr, "ERR:  buf_need: out of memory\n");
-          exit(1);
+          iov->iov_base = (char *)iov->iov_base + done;
+          iov->iov_len -= done;
         } /*if*/
-      memset(bigbuf + bigbufsize, 0, newbufsize - bigbufsize); /* zero added memory */
-      bigbufsize = newbufsize;
+    } /*while*/
+  if (total != 0)
+    {
+      fprintf(stderr, "\nERR:  Error %d -- %s -- writing %s\n", errno, strerror(errno), fname);
+      return false;
     } /*if*/
-} /*buf_need*/
+  return true;
+} /*write_iov*/
 
-static void buf_write1(size_t o, unsigned char b)
-/* puts a byte into buf at offset o. */
-{
-  buf_need(o + 1);
-  bigbuf[o] = b;
-}/*buf_write1*/
+static const struct vmgi_header vmgi_template =
+  /* everything in the VMG IFO header that doesn't depend on the disc contents;
+     TocGen fills in the rest. */
+  {
+    .mat =
+      {
+        .vmg_id = "DVDVIDEO-VMG",
+        .version = 0x11,
+        .num_volumes = {0, 1},
+        .volume_number = {0, 1},
+        .side_id = 1,
+        .provider_id = PACKAGE_STRING,
+        .fp_pgc_start = {0, 0, 0x04, 0x00}, /* FP_PGC immediately follows VMGI_MAT */
+        .tt_srpt_sector = {0, 0, 0, 1}, /* TT_SRPT immediately follows IFO header */
+        .vmgi_mat_last_byte =
+          {
+            0, 0,
+            (offsetof(struct vmgi_header, fp_pgc.cmds[1]) - 1) >> 8,
+            (offsetof(struct vmgi_header, fp_pgc.cmds[1]) - 1) & 255,
+          },
+      },
+    .fp_pgc =
+      {
+        .cmd_tbl_offset = {0, offsetof(struct fp_pgc, cmd_tbl)},
+        .cmd_tbl =
+          {
+            .num_pre = {0, 1}, /* one pre command, filled in by TocGen */
+            .last_byte = {0, sizeof(struct pgc_cmd_tbl_hdr) + VM_CMD_SIZE - 1},
+          },
+      },
+  };
 
-static void buf_write2(size_t o, unsigned short w)
-/* puts a big-endian word into buf at offset o. */
-{
-  buf_need(o + 2);
-  bigbuf[o] = w >> 8 & 255;
-  bigbuf[o + 1] = w & 255;
-} /*buf_write2*/
+static const unsigned char fp_jump_vtsm[VM_CMD_SIZE] =
+  {0x30, 0x06, 0x00, 0x01, 0x01, 0x83, 0x00, 0x00}; /* jump to VTSM vts=1, ttn=1, menu=1 */
+static const unsigned char fp_jump_title[VM_CMD_SIZE] =
+  {0x30, 0x02, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00}; /* jump to title 1 */
 
-static void buf_write4(size_t o, unsigned int l)
-/* puts a big-endian longword into buf at offset o. */
+static int TT_SRPT_sectors(const struct toc_summary *ts)
+/* returns the number of sectors Create_TT_SRPT will generate. */
 {
-  buf_need(o + 4);
-  bigbuf[o] = l >> 24 & 255;
-  bigbuf[o + 1] = l >> 16 & 255;
-  bigbuf[o + 2] = l >> 8 & 255;
-  bigbuf[o + 3] = l & 255;
-} /*buf_write4*/
-
-static void nfwrite(const void *ptr, size_t len, FILE *h)
-/* writes to h, or turns into a noop if h is null. */
-{
-  if (h)
-    {
-      errno = 0; /* where is this being set? */
-      (void)fwrite(ptr, len, 1, h);
-      if (errno != 0)
-        {
-          fprintf
-            (
-             stderr,
-             "\nERR:  Error %d -- %s -- writing output IFO\n",
-             errno,
-             strerror(errno)
-             );
-          exit(1);
-        } /*if*/
-    } /*if*/
-} /*nfwrite*/
+  int i, tn = 0;
+  for (i = 0; i < ts->numvts; i++)
+    tn += ts->vts[i].numtitles;
+  return
+    (sizeof(struct tt_srpt_hdr) + tn * sizeof(struct tt_srpt_entry) + DVD_SECTOR_SIZE - 1)
+    /
+    DVD_SECTOR_SIZE;
+} /*TT_SRPT_sectors*/
 
-static int Create_TT_SRPT
+static unsigned char *Create_TT_SRPT
 (
- FILE *h,
  const struct toc_summary *ts,
- int vtsstart /* starting sector for VTS */
+ int vtsstart, /* starting sector for VTS */
+ size_t *size /* returns size of TT_SRPT in bytes, a whole number of sectors */
  )
-/* creates a TT_SRPT structure containing pointers to all the titles on the disc. */
+/* creates a TT_SRPT structure containing pointers to all the titles on the disc,
+   in a newly-allocated buffer. */
 {
+  struct tt_srpt_hdr *hdr;
+  struct tt_srpt_entry *e;
+  unsigned char *buf;
   int i, j, k, p, tn;
-  buf_init();
+  *size = TT_SRPT_sectors(ts) * DVD_SECTOR_SIZE;
+  buf = calloc(1, *size);
+  if (!buf)
+    {
+      fprintf(stderr, "ERR:  Create_TT_SRPT: out of memory\n");
+      exit(1);
+    } /*if*/
   j = vtsstart;
   tn = 0;
-  p = 8; /* offset to first entry */
+  p = sizeof(struct tt_srpt_hdr); /* offset to first entry */
   for (i = 0; i < ts->numvts; i++)
     {
       for (k = 0; k < ts->vts[i].numtitles; k++)
         {
-          buf_write1(0 + p, 0x3c);
+          e = (struct tt_srpt_entry *)(buf + p);
+          e->title_type = 0x3c;
           /* title type = one sequential PGC, jump/link/call may be found in all places,
              PTT & time play/search uops not inhibited */
-          buf_write1(1 + p, 0x1); /* number of angles always 1 for now */
-          buf_write2(2 + p, ts->vts[i].numchapters[k]); /* number of chapters (PTTs) */
-          buf_write1(6 + p, i + 1); /* video titleset number, VTSN */
-          buf_write1(7 + p, k + 1); /* title nr within VTS, VTS_TTN */
-          buf_write4(8 + p, j); // start sector for VTS
+          e->num_angles = 0x1; /* number of angles always 1 for now */
+          write2(e->num_ptts, ts->vts[i].numchapters[k]); /* number of chapters (PTTs) */
+          e->vtsn = i + 1; /* video titleset number, VTSN */
+          e->vts_ttn = k + 1; /* title nr within VTS, VTS_TTN */
+          write4(e->vts_start_sector, j); // start sector for VTS
           tn++;
-          p += 12; /* offset to next entry */
+          p += sizeof(struct tt_srpt_entry); /* offset to next entry */
         } /*for*/
       j += ts->vts[i].numsectors;
     } /*for*/
-  buf_write2(0, tn); // # of titles
-  buf_write4(4, p - 1); /* end address (last byte of last entry) */
-  p = (p + 2047) & (-2048); /* round up to next whole sector */
-  nfwrite(bigbuf, p, h);
-  return p / 2048; /* nr sectors generated */
+  hdr = (struct tt_srpt_hdr *)buf;
+  write2(hdr->num_titles, tn); // # of titles
+  write4(hdr->last_byte, p - 1); /* end address (last byte of last entry) */
+  return buf;
 } /*Create_TT_SRPT*/
 
-void TocGen(const struct workset *ws, const char *fname)
-/* writes the IFO for a VMGM. */
+struct vmg_image *TocGen(const struct workset *ws)
+/* lays out the IFO for a VMGM in memory. The result refers to the VTS IFO headers
+   in ws->titlesets, which must not be freed until it has been written out. */
 {
-  static unsigned char buf[2048];
-  int nextsector, offset, i, j, vtsstart;
-  
-  FILE *h;
-
-  h = fopen(fname, "wb");
-
-  memset(buf, 0, 2048);
-  memcpy(buf, "DVDVIDEO-VMG", 12);
-  buf[0x21] = 0x11; /* version number */
-  buf[0x27] = 1; /* number of volumes */
-  buf[0x29] = 1; /* volume number */
-  buf[0x2a] = 1; /* side ID */
-  write2(buf + 0x3e, ws->titlesets->numvts); /* number of title sets */
-  strncpy((char *)(buf + 0x40), PACKAGE_STRING, 31); /* provider ID */
-  buf[0x86] = 4; /* start address of FP_PGC = 0x400 */
-  nextsector = 1;
-
-  write4(buf + 0xc4, nextsector); /* sector pointer to TT_SRPT (table of titles) */
-  nextsector += Create_TT_SRPT(0, ws->titlesets, 0);
-  /* just to figure out how many sectors will be needed */
-
-  write4(buf + 0xd0, nextsector);
+  struct vmg_image * const img = calloc(1, sizeof(struct vmg_image));
+  struct iovec * const iov = img->iov;
+  static const unsigned char zero[DVD_SECTOR_SIZE];
+  int nextsector, i, j, vtsstart, niov;
+  const int numvts = ws->titlesets->numvts;
+
+  if (!img)
+    {
+      fprintf(stderr, "ERR:  TocGen: out of memory\n");
+      exit(1);
+    } /*if*/
+  img->hdr = vmgi_template;
+  write2(img->hdr.mat.num_titlesets, numvts); /* number of title sets */
+  nextsector = 1 + TT_SRPT_sectors(ws->titlesets);
+
+  write4(img->hdr.mat.vts_atrt_sector, nextsector);
   /* sector pointer to VMG_VTS_ATRT (copies of VTS audio/subpicture attrs) */
-  /* I will output it immediately following IFO header */
-  nextsector += (8 + ws->titlesets->numvts * 0x30c + 2047) / 2048;
+  /* I will output it immediately following TT_SRPT */
+  nextsector +=
+      (sizeof(struct vmg_vts_atrt_hdr) + numvts * (4 + sizeof(struct vts_atrt)) + DVD_SECTOR_SIZE - 1)
+      /
+      DVD_SECTOR_SIZE;
   /* round up size of VMG_VTS_ATRT to whole sectors */
 
-  write4(buf + 0x1c, nextsector - 1); /* last sector of IFO */
+  write4(img->hdr.mat.vmgi_last_sector, nextsector - 1); /* last sector of IFO */
   vtsstart = nextsector * 2; /* size of two copies of everything above including BUP */
-  write4(buf + 0xc, vtsstart - 1); /* last sector of VMG set (last sector of BUP) */
+  write4(img->hdr.mat.vmg_last_sector, vtsstart - 1); /* last sector of VMG set (last sector of BUP) */
 
-  /* create FPC at 0x400 as promised */
-  buf[0x407] = (getratedenom(ws->menus->vg) == 90090 ? 3 : 1) << 6;
+  /* fill in FPC, including its single pre command */
+  img->hdr.fp_pgc.playback_time[3] = (getratedenom(ws->menus->vg) == 90090 ? 3 : 1) << 6;
   // only set frame rate XXX: should check titlesets if there is no VMGM menu
-  buf[0x4e5] = 0xec; /* offset to command table, low byte */
-  offset = 0x4f4; /* commands start here, after 8-byte header of command table */
-
-  {
-      if (ws->titlesets->numvts && ws->titlesets->vts[0].hasmenu)
-        {
-          buf[offset + 0] = 0x30; // jump to VTSM vts=1, ttn=1, menu=1
-          buf[offset + 1] = 0x06;
-          buf[offset + 2] = 0x00;
-          buf[offset + 3] = 0x01;
-          buf[offset + 4] = 0x01;
-          buf[offset + 5] = 0x83;
-          buf[offset + 6] = 0x00;
-          buf[offset + 7] = 0x00;
-        }
-      else
-        {
-          buf[offset + 0] = 0x30; // jump to title 1
-          buf[offset + 1] = 0x02;
-          buf[offset + 2] = 0x00;
-          buf[offset + 3] = 0x00;
-          buf[offset + 4] = 0x00;
-          buf[offset + 5] = 0x01;
-          buf[offset + 6] = 0x00;
-          buf[offset + 7] = 0x00;
-        } /*if*/
-      buf[0x4ed] = 1; /* number of pre commands, low byte */
-    } /*if*/
-  write2(buf + 0x4f2, 7 + buf[0x4ed] * 8); /* end address relative to command table */
-  write2(buf + 0x82 /* end byte address, low word, of VMGI_MAT */, 0x4ec + read2(buf + 0x4f2));
-  nfwrite(buf, 2048, h);
-
-  Create_TT_SRPT(h, ws->titlesets, vtsstart); /* generate it for real */
+  memcpy
+    (
+      img->hdr.fp_pgc.cmds[0],
+      numvts && ws->titlesets->vts[0].hasmenu ? fp_jump_vtsm : fp_jump_title,
+      VM_CMD_SIZE
+    );
+  niov = 0;
+  iov[niov].iov_base = &img->hdr;
+  iov[niov++].iov_len = sizeof img->hdr;
+  img->tt_srpt = Create_TT_SRPT(ws->titlesets, vtsstart, &iov[niov].iov_len);
+  iov[niov++].iov_base = img->tt_srpt;
 
   /* VMG_VTS_ATRT contains copies of menu and title attributes from all titlesets */
-  /* output immediately following IFO header, as promised above */
-  memset(buf, 0, 2048);
-  j = 8 + ws->titlesets->numvts * 4;
-  write2(buf, ws->titlesets->numvts); /* number of titlesets */
-  write4(buf + 4, ws->titlesets->numvts * 0x30c + 8 - 1); /* end address (last byte of last VTS_ATRT) */
-  for (i = 0; i < ws->titlesets->numvts; i++)
-    write4(buf + 8 + i * 4, j + i * 0x308); /* offset to VTS_ATRT i */
-  nfwrite(buf, j, h);
-  for (i = 0; i < ws->titlesets->numvts; i++) /* output each VTS_ATRT */
+  /* output immediately following TT_SRPT, as promised above */
+  j = sizeof img->atrthdr + numvts * 4;
+  write2(img->atrthdr.num_vts, numvts); /* number of titlesets */
+  write4(img->atrthdr.last_byte, j + numvts * sizeof(struct vts_atrt) - 1);
+  /* end address (last byte of last VTS_ATRT) */
+  for (i = 0; i < numvts; i++)
+    write4(img->offsets + i * 4, j + i * sizeof(struct vts_atrt)); /* offset to VTS_ATRT i */
+  write4(img->atrtlast, sizeof(struct vts_atrt) - 1); /* end address, same for every VTS_ATRT */
+  /* the attributes are written straight from the VTS IFO headers kept by ScanIfo */
+  iov[niov].iov_base = &img->atrthdr;
+  iov[niov++].iov_len = sizeof img->atrthdr;
+  iov[niov].iov_base = img->offsets;
+  iov[niov++].iov_len = numvts * 4;
+  for (i = 0; i < numvts; i++) /* output each VTS_ATRT */
     {
-      write4(buf, 0x307); /* end address */
-      memcpy(buf + 4, ws->titlesets->vts[i].vtscat, 4);
-      /* VTS_CAT (copy of bytes 0x22 .. 0x25 of VTS IFO) */
-      memcpy(buf + 8, ws->titlesets->vts[i].vtssummary, 0x300);
-      /* copy of VTS attributes (bytes 0x100 onwards of VTS IFO) */
-      nfwrite(buf, 0x308, h);
-      j += 0x308;
+      const struct vtsi_mat * const mat = &ws->titlesets->vts[i].mat;
+      iov[niov].iov_base = img->atrtlast;
+      iov[niov++].iov_len = sizeof img->atrtlast;
+      iov[niov].iov_base = (void *)mat->vts_category; /* VTS_CAT (bytes 0x22 .. 0x25 of VTS IFO) */
+      iov[niov++].iov_len = sizeof mat->vts_category;
+      iov[niov].iov_base = (void *)mat->vts_attrs; /* VTS attributes (bytes 0x100 onwards of VTS IFO) */
+      iov[niov++].iov_len = sizeof mat->vts_attrs;
+      j += sizeof(struct vts_atrt);
     } /*for*/
-  j = 2048 - (j & 2047);
-  if (j < 2048)
+  j = DVD_SECTOR_SIZE - (j & (DVD_SECTOR_SIZE - 1));
+  if (j < DVD_SECTOR_SIZE)
     { /* pad to next whole sector */
-      memset(buf, 0, j);
-      nfwrite(buf, j, h);
+      iov[niov].iov_base = (void *)zero;
+      iov[niov++].iov_len = j;
     } /*if*/
+  img->niov = niov;
+  for (i = 0; i < niov; i++)
+    img->crc = crc32c(img->crc, iov[i].iov_base, iov[i].iov_len);
+  return img;
+} /*TocGen*/
 
-  fflush(h);
-  if (errno != 0)
+bool vmg_image_write(const struct vmg_image *img, int dirfd, const char *fname)
+/* writes out a VMG IFO laid out by TocGen to fname in dirfd, and makes sure it
+   is on disk before returning, so it can be renamed into place safely. Returns
+   false if it couldn't be, leaving the caller to get rid of it. */
+{
+  struct iovec iov[VMG_IMAGE_IOVS];
+  int fd;
+  bool ok;
+  io_delay(IO_OPEN);
+  fd = openat(dirfd, fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
     {
-      fprintf(stderr, "\nERR:  Error %d -- %s -- flushing VMGM\n", errno, strerror(errno));
-      exit(1);
+      fprintf(stderr, "ERR:  cannot create %s: %s\n", fname, strerror(errno));
+      return false;
     } /*if*/
-  fclose(h);
-} /*TocGen*/
+  memcpy(iov, img->iov, img->niov * sizeof(struct iovec)); /* write_iov clobbers it */
+  ok = write_iov(fd, iov, img->niov, fname);
+  io_delay(IO_FSYNC);
+  if (ok && fsync(fd) != 0)
+    {
+      fprintf(stderr, "\nERR:  Error %d -- %s -- syncing %s\n", errno, strerror(errno), fname);
+      ok = false;
+    } /*if*/
+  if (close(fd) != 0 && ok)
+    {
+      fprintf(stderr, "\nERR:  Error %d -- %s -- closing %s\n", errno, strerror(errno), fname);
+      ok = false;
+    } /*if*/
+  return ok;
+} /*vmg_image_write*/
 
+void vmg_image_free(struct vmg_image *img)
+{
+  if (!img)
+    return;
+  free(img->tt_srpt);
+  free(img);
+} /*vmg_image_free*/
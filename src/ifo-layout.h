@@ -0,0 +1,195 @@
+/*
+    On-disk layout of the IFO structures read and written by mkinfo.
+    All multi-byte fields are big-endian and are declared as byte arrays,
+    so the structures have no padding and can be overlaid directly on
+    sector buffers; use read2/read4/write2/write4 to access them.
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+#ifndef __MI_IFO_LAYOUT_H_
+#define __MI_IFO_LAYOUT_H_
+
+#include <stddef.h>
+
+#define DVD_SECTOR_SIZE 2048
+
+#define LAYOUT_CHECK(type, field, offset) \
+    _Static_assert(offsetof(type, field) == (offset), #type "." #field " must be at " #offset)
+#define LAYOUT_SIZE(type, size) \
+    _Static_assert(sizeof(type) == (size), "sizeof(" #type ") must be " #size)
+
+typedef unsigned char be2[2];
+typedef unsigned char be4[4];
+
+struct vmgi_mat { /* VMG information management table, start of VIDEO_TS.IFO */
+    char vmg_id[12]; /* "DVDVIDEO-VMG" */
+    be4 vmg_last_sector; /* last sector of VMG set (last sector of BUP) */
+    unsigned char pad0[12];
+    be4 vmgi_last_sector; /* last sector of IFO */
+    unsigned char pad1;
+    unsigned char version;
+    be4 vmg_category;
+    be2 num_volumes;
+    be2 volume_number;
+    unsigned char side_id;
+    unsigned char pad2[19];
+    be2 num_titlesets;
+    char provider_id[32];
+    unsigned char pos_code[8];
+    unsigned char pad3[24];
+    be4 vmgi_mat_last_byte; /* end byte address of VMGI_MAT */
+    be4 fp_pgc_start; /* byte offset of FP_PGC */
+    unsigned char pad4[56];
+    be4 vmgm_vobs_sector;
+    be4 tt_srpt_sector; /* table of titles */
+    be4 vmgm_pgci_ut_sector;
+    be4 ptl_mait_sector;
+    be4 vts_atrt_sector; /* copies of VTS audio/subpicture attrs */
+    be4 txtdt_mg_sector;
+    be4 vmgm_c_adt_sector;
+    be4 vmgm_vobu_admap_sector;
+    unsigned char pad5[32];
+    unsigned char vmgm_attrs[0x300]; /* VMGM video/audio/subpicture attributes */
+};
+LAYOUT_CHECK(struct vmgi_mat, vmg_last_sector, 0x0c);
+LAYOUT_CHECK(struct vmgi_mat, vmgi_last_sector, 0x1c);
+LAYOUT_CHECK(struct vmgi_mat, version, 0x21);
+LAYOUT_CHECK(struct vmgi_mat, num_volumes, 0x26);
+LAYOUT_CHECK(struct vmgi_mat, side_id, 0x2a);
+LAYOUT_CHECK(struct vmgi_mat, num_titlesets, 0x3e);
+LAYOUT_CHECK(struct vmgi_mat, provider_id, 0x40);
+LAYOUT_CHECK(struct vmgi_mat, vmgi_mat_last_byte, 0x80);
+LAYOUT_CHECK(struct vmgi_mat, fp_pgc_start, 0x84);
+LAYOUT_CHECK(struct vmgi_mat, tt_srpt_sector, 0xc4);
+LAYOUT_CHECK(struct vmgi_mat, vts_atrt_sector, 0xd0);
+LAYOUT_CHECK(struct vmgi_mat, vmgm_attrs, 0x100);
+LAYOUT_SIZE(struct vmgi_mat, 0x400);
+
+struct pgc_cmd_tbl_hdr { /* header of a PGC command table */
+    be2 num_pre;
+    be2 num_post;
+    be2 num_cell;
+    be2 last_byte; /* end address relative to start of table */
+};
+LAYOUT_SIZE(struct pgc_cmd_tbl_hdr, 8);
+
+#define VM_CMD_SIZE 8
+
+struct fp_pgc { /* first-play PGC, with room for a few pre commands */
+    unsigned char pad0[2];
+    unsigned char num_programs;
+    unsigned char num_cells;
+    be4 playback_time; /* BCD h:m:s:f; top two bits of last byte give frame rate */
+    be4 prohibited_uops;
+    be2 audio_control[8];
+    be4 subp_control[32];
+    be2 next_pgcn;
+    be2 prev_pgcn;
+    be2 goup_pgcn;
+    unsigned char still_time;
+    unsigned char playback_mode;
+    be4 palette[16];
+    be2 cmd_tbl_offset; /* offsets relative to start of PGC */
+    be2 program_map_offset;
+    be2 cell_playback_offset;
+    be2 cell_position_offset;
+    struct pgc_cmd_tbl_hdr cmd_tbl;
+    unsigned char cmds[4][VM_CMD_SIZE];
+};
+LAYOUT_CHECK(struct fp_pgc, playback_time, 0x04);
+LAYOUT_CHECK(struct fp_pgc, next_pgcn, 0x9c);
+LAYOUT_CHECK(struct fp_pgc, palette, 0xa4);
+LAYOUT_CHECK(struct fp_pgc, cmd_tbl_offset, 0xe4);
+LAYOUT_CHECK(struct fp_pgc, cmd_tbl, 0xec);
+LAYOUT_CHECK(struct fp_pgc, cmds, 0xf4);
+
+struct vmgi_header { /* first sector of VIDEO_TS.IFO */
+    struct vmgi_mat mat;
+    struct fp_pgc fp_pgc; /* pointed to by mat.fp_pgc_start */
+    unsigned char pad[DVD_SECTOR_SIZE - sizeof(struct vmgi_mat) - sizeof(struct fp_pgc)];
+};
+LAYOUT_CHECK(struct vmgi_header, fp_pgc, 0x400);
+LAYOUT_SIZE(struct vmgi_header, DVD_SECTOR_SIZE);
+
+struct tt_srpt_hdr { /* header of TT_SRPT (table of titles) */
+    be2 num_titles;
+    unsigned char pad[2];
+    be4 last_byte; /* end address (last byte of last entry) */
+};
+LAYOUT_SIZE(struct tt_srpt_hdr, 8);
+
+struct tt_srpt_entry { /* one title in TT_SRPT */
+    unsigned char title_type;
+    unsigned char num_angles;
+    be2 num_ptts; /* number of chapters */
+    be2 parental_mask;
+    unsigned char vtsn; /* video titleset number */
+    unsigned char vts_ttn; /* title nr within VTS */
+    be4 vts_start_sector;
+};
+LAYOUT_SIZE(struct tt_srpt_entry, 12);
+
+struct vmg_vts_atrt_hdr { /* header of VMG_VTS_ATRT, followed by one be4 offset per VTS */
+    be2 num_vts;
+    unsigned char pad[2];
+    be4 last_byte;
+};
+LAYOUT_SIZE(struct vmg_vts_atrt_hdr, 8);
+
+struct vts_atrt { /* attribute copy for one titleset in VMG_VTS_ATRT */
+    be4 last_byte; /* end address relative to start of entry */
+    be4 vts_category;
+    unsigned char vts_attrs[0x300]; /* copy of bytes 0x100 .. 0x3ff of the VTS IFO */
+};
+LAYOUT_SIZE(struct vts_atrt, 0x308);
+
+struct vtsi_mat { /* VTS information management table, start of VTS_nn_0.IFO */
+    char vts_id[12]; /* "DVDVIDEO-VTS" */
+    be4 vts_last_sector; /* last sector of title set (last sector of BUP) */
+    unsigned char pad0[12];
+    be4 vtsi_last_sector; /* last sector of IFO */
+    unsigned char pad1;
+    unsigned char version;
+    be4 vts_category;
+    unsigned char pad2[90];
+    be4 vtsi_mat_last_byte;
+    unsigned char pad3[60];
+    be4 vtsm_vobs_sector; /* start sector of menu VOB, 0 if none */
+    be4 vtstt_vobs_sector;
+    be4 vts_ptt_srpt_sector;
+    be4 vts_pgcit_sector;
+    unsigned char pad4[48];
+    unsigned char vts_attrs[0x300]; /* menu and title video/audio/subpicture attributes */
+};
+LAYOUT_CHECK(struct vtsi_mat, vts_last_sector, 0x0c);
+LAYOUT_CHECK(struct vtsi_mat, vtsi_last_sector, 0x1c);
+LAYOUT_CHECK(struct vtsi_mat, vts_category, 0x22);
+LAYOUT_CHECK(struct vtsi_mat, vtsi_mat_last_byte, 0x80);
+LAYOUT_CHECK(struct vtsi_mat, vtsm_vobs_sector, 0xc0);
+LAYOUT_CHECK(struct vtsi_mat, vts_ptt_srpt_sector, 0xc8);
+LAYOUT_CHECK(struct vtsi_mat, vts_attrs, 0x100);
+LAYOUT_SIZE(struct vtsi_mat, 0x400);
+
+struct vts_ptt_srpt_hdr { /* header of VTS_PTT_SRPT, followed by one be4 offset per title */
+    be2 num_titles;
+    unsigned char pad[2];
+    be4 last_byte; /* end address (last byte of last VTS_PTT) */
+};
+LAYOUT_SIZE(struct vts_ptt_srpt_hdr, 8);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+    mkinfo -- making storage operations artificially slow, to see how things
+    behave on network storage without needing any
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+/*
+    Each place that opens, lists, reads, writes or syncs something on the
+    storage being processed calls io_delay first, which does nothing unless
+    --io-latency was given. Then it sleeps for the fixed delay configured for
+    that kind of operation, plus a random amount with an exponential
+    distribution (which gives the long tail seen on real network storage),
+    and occasionally, with a given probability, for a much longer stall.
+
+    The profile is a comma-separated list of:
+
+        lan-nfs, wan-nfs   presets, roughly like NFS over a local network
+                           or a long-distance link, which can be adjusted
+                           by the settings following them
+        delay=MS           fixed delay for every kind of operation
+        open=MS, readdir=MS, read=MS, write=MS, fsync=MS
+                           fixed delay for one kind of operation
+        jitter=MS          mean of the random extra delay
+        stall=PERCENT@MS   chance of a stall, and how long it lasts
+        seed=N             for the random numbers, to make runs repeatable
+*/
+
+#include "config.h"
+#include "compat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "mkinfo.h"
+
+struct io_profile {
+    double delay[IO_NUMOPS]; /* fixed delay for each kind of operation, ms */
+    double jitter; /* mean random extra delay, ms */
+    double stallchance; /* probability of a stall, 0 .. 1 */
+    double stall; /* length of a stall, ms */
+};
+
+static const struct
+  {
+    const char *name;
+    struct io_profile profile;
+  } presets[] =
+  {
+    {"lan-nfs", {{0.3, 0.5, 0.2, 0.3, 4}, 0.5, 0.0005, 200}},
+    {"wan-nfs", {{20, 30, 20, 20, 60}, 10, 0.002, 3000}},
+  };
+
+static const char * const opnames[IO_NUMOPS] = {"open", "readdir", "read", "write", "fsync"};
+
+static bool enabled = false;
+static struct io_profile profile;
+static uint64_t seed = 1;
+static pid_t mainpid; /* process the profile was set up in */
+static atomic_uint_fast64_t numthreads; /* for giving each thread its own random numbers */
+static _Thread_local uint64_t state; /* for random numbers, 0 if not yet seeded */
+static _Thread_local pid_t statepid; /* process it was seeded in */
+
+static double uniform(void)
+/* returns a random number in (0, 1]. */
+{
+  if (!state || statepid != getpid())
+    {
+      /* so that worker processes, and threads, don't all get the same sequence,
+         while a run in a single thread always gets the same one for the same seed */
+      const uint64_t pid = getpid() != mainpid ? getpid() : 0;
+      state = (seed ^ pid << 32 ^ atomic_fetch_add(&numthreads, 1) << 16) * 0x9e3779b97f4a7c15ULL | 1;
+      statepid = getpid();
+    } /*if*/
+  /* xorshift64* */
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return ((state * 0x2545f4914f6cdd1dULL >> 11) + 1) / 9007199254740992.0;
+} /*uniform*/
+
+bool io_latency_parse(const char *spec)
+/* sets up the latency profile from spec as described above, returning false if
+   it doesn't make sense. */
+{
+  char * const copy = strdup(spec);
+  char *item, *rest = copy;
+  bool ok = true;
+  memset(&profile, 0, sizeof profile);
+  while (ok && (item = strsep(&rest, ",")) != 0)
+    {
+      char * const value = strchr(item, '=');
+      char *end;
+      double n;
+      size_t i;
+      if (!value)
+        {
+          ok = false;
+          for (i = 0; i < sizeof presets / sizeof presets[0]; i++)
+            if (!strcmp(item, presets[i].name))
+              {
+                profile = presets[i].profile;
+                ok = true;
+              } /*if; for*/
+          continue;
+        } /*if*/
+      *value = 0;
+      n = strtod(value + 1, &end);
+      if (n < 0 || end == value + 1)
+        ok = false;
+      else if (!strcmp(item, "stall"))
+        {
+          profile.stallchance = n / 100;
+          ok = *end == '@' && n <= 100;
+          if (ok)
+            {
+              const char * const ms = end + 1;
+              profile.stall = strtod(ms, &end);
+              ok = profile.stall >= 0 && end != ms && *end == 0;
+            } /*if*/
+        }
+      else if (*end != 0)
+        ok = false;
+      else if (!strcmp(item, "delay"))
+        for (i = 0; i < IO_NUMOPS; i++)
+          profile.delay[i] = n;
+      else if (!strcmp(item, "jitter"))
+        profile.jitter = n;
+      else if (!strcmp(item, "seed"))
+        seed = n;
+      else
+        {
+          ok = false;
+          for (i = 0; i < IO_NUMOPS; i++)
+            if (!strcmp(item, opnames[i]))
+              {
+                profile.delay[i] = n;
+                ok = true;
+              } /*if; for*/
+        } /*if*/
+    } /*while*/
+  free(copy);
+  mainpid = getpid();
+  enabled = ok;
+  return ok;
+} /*io_latency_parse*/
+
+void io_delay(enum io_op op)
+/* holds things up as though about to do a storage operation of kind op, if
+   --io-latency says to. */
+{
+  double ms;
+  struct timespec t;
+  if (!enabled)
+    return;
+  ms = profile.delay[op];
+  if (profile.jitter > 0)
+    ms -= profile.jitter * log(uniform());
+  if (profile.stallchance > 0 && uniform() <= profile.stallchance)
+    ms += profile.stall;
+  t.tv_sec = ms / 1000;
+  t.tv_nsec = (ms - t.tv_sec * 1000.0) * 1e6;
+  while (nanosleep(&t, &t) != 0 && errno == EINTR)
+    /* keep going */;
+} /*io_delay*/
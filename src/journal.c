@@ -0,0 +1,245 @@
+/*
+    mkinfo -- journal of directories already dealt with, for resuming long runs
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+/*
+    The journal is an append-only text file with one line per directory
+    processed:
+
+        <crc> <status> <output crc> <directory>
+
+    where <status> is DONE (VMG generated), SKIP (nothing needed doing), FAIL
+    or TIME (abandoned after exceeding the --timeout deadline), <output crc>
+    is the CRC-32C of the generated VIDEO_TS.IFO (0 if none), and <crc> is the
+    CRC-32C of the rest of the line, so that a line torn by a crash is
+    recognised and ignored. Directories recorded as DONE
+    or SKIP are not looked at again; failed ones are retried.
+
+    Records are flushed and fdatasync'ed in batches rather than one at a
+    time: a crash can lose the last few records, which only means those
+    directories get checked again.
+*/
+
+#include "config.h"
+#include "compat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mkinfo.h"
+#include "mi-internal.h"
+
+#define JOURNAL_SYNC_RECORDS 256 /* sync after this many records */
+#define JOURNAL_SYNC_SECONDS 2 /* or after this long */
+
+struct journal {
+    FILE *h;
+    char *fname;
+    char **done; /* hash set of finished directory names, NULL for empty slot */
+    size_t donemask; /* size of done - 1, a power of 2 minus 1 */
+    size_t numdone;
+    int unsynced; /* records written since last sync */
+    time_t lastsync;
+    pthread_mutex_t lock; /* for use from multiple threads */
+};
+
+static size_t hashname(const char *s)
+/* FNV-1a */
+{
+  size_t h = 2166136261u;
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  return h;
+} /*hashname*/
+
+static char **done_slot(struct journal *j, const char *dirname)
+/* returns the slot in the done set holding dirname, or the empty one where it would go. */
+{
+  size_t h = hashname(dirname);
+  for (;;)
+    {
+      char ** const slot = j->done + (h & j->donemask);
+      if (!*slot || !strcmp(*slot, dirname))
+        return slot;
+      h++;
+    } /*for*/
+} /*done_slot*/
+
+static void add_done(struct journal *j, const char *dirname)
+{
+  char **slot;
+  if ((j->numdone + 1) * 2 > j->donemask + 1)
+    {
+      /* keep load factor at most 1/2 */
+      char ** const old = j->done;
+      const size_t oldsize = j->donemask + 1;
+      size_t i;
+      j->donemask = j->donemask * 2 + 1;
+      j->done = calloc(j->donemask + 1, sizeof(char *));
+      if (!j->done)
+        {
+          fprintf(stderr, "ERR:  journal: out of memory\n");
+          exit(1);
+        } /*if*/
+      for (i = 0; i < oldsize; i++)
+        if (old[i])
+          *done_slot(j, old[i]) = old[i];
+      free(old);
+    } /*if*/
+  slot = done_slot(j, dirname);
+  if (!*slot)
+    {
+      *slot = strdup(dirname);
+      j->numdone++;
+    } /*if*/
+} /*add_done*/
+
+static bool load(struct journal *j, FILE *h)
+/* reads the records of an existing journal. Returns true if the last line was
+   torn, so a newline must be written before appending more. */
+{
+  char *line = 0;
+  size_t linesize = 0;
+  ssize_t len;
+  unsigned int crc, outcrc;
+  int namepos, bad = 0;
+  bool torn = false;
+  char status[5];
+
+  while ((len = getline(&line, &linesize, h)) > 0)
+    {
+      if (line[len - 1] != '\n')
+        {
+          bad++;
+          torn = true;
+          break;
+        } /*if*/
+      line[--len] = 0;
+      if
+        (
+            sscanf(line, "%8x %4s %8x %n", &crc, status, &outcrc, &namepos) != 3
+        ||
+            len < 9
+        ||
+            crc32c(0, line + 9, len - 9) != crc
+        )
+        {
+          bad++;
+          continue;
+        } /*if*/
+      if (!strcmp(status, "DONE") || !strcmp(status, "SKIP"))
+        add_done(j, line + namepos);
+    } /*while*/
+  free(line);
+  if (bad)
+    fprintf(stderr, "WARN: ignored %d damaged records in journal %s\n", bad, j->fname);
+  return torn;
+} /*load*/
+
+struct journal *journal_open(const char *fname)
+/* opens the journal, creating it if it doesn't exist, and loads the list of
+   directories already finished. */
+{
+  struct journal * const j = calloc(1, sizeof(struct journal));
+  FILE *h;
+  bool torn = false;
+  j->fname = strdup(fname);
+  j->donemask = 1023;
+  j->done = calloc(j->donemask + 1, sizeof(char *));
+  h = fopen(fname, "r");
+  if (h)
+    {
+      torn = load(j, h);
+      fclose(h);
+      fprintf(stderr, "INFO: journal %s: %lu directories already finished\n", fname, (unsigned long)j->numdone);
+    } /*if*/
+  j->h = fopen(fname, "a");
+  if (!j->h)
+    {
+      fprintf(stderr, "ERR:  cannot open journal %s: %s\n", fname, strerror(errno));
+      exit(1);
+    } /*if*/
+  if (torn)
+    fputc('\n', j->h);
+  j->lastsync = time(0);
+  pthread_mutex_init(&j->lock, 0);
+  return j;
+} /*journal_open*/
+
+bool journal_finished(struct journal *j, const char *dirname)
+/* has dirname already been done according to the journal. */
+{
+  bool result;
+  pthread_mutex_lock(&j->lock);
+  result = *done_slot(j, dirname) != 0;
+  pthread_mutex_unlock(&j->lock);
+  return result;
+} /*journal_finished*/
+
+static void journal_sync(struct journal *j)
+{
+  io_delay(IO_FSYNC);
+  if (fflush(j->h) != 0 || fdatasync(fileno(j->h)) != 0)
+    {
+      fprintf(stderr, "ERR:  Error %d -- %s -- writing journal %s\n", errno, strerror(errno), j->fname);
+      exit(1);
+    } /*if*/
+  j->unsynced = 0;
+  j->lastsync = time(0);
+} /*journal_sync*/
+
+void journal_record(struct journal *j, const char *dirname, enum journal_status status, unsigned int outcrc)
+/* appends a record of what happened to dirname. */
+{
+  static const char * const statusnames[] = {"DONE", "SKIP", "FAIL", "TIME"};
+  char *rest;
+  const int len = asprintf(&rest, "%s %08x %s", statusnames[status], outcrc, dirname);
+  if (len < 0)
+    {
+      fprintf(stderr, "ERR:  journal: out of memory\n");
+      exit(1);
+    } /*if*/
+  pthread_mutex_lock(&j->lock);
+  fprintf(j->h, "%08x %s\n", crc32c(0, rest, len), rest);
+  free(rest);
+  if (status == JOURNAL_DONE || status == JOURNAL_SKIP)
+    add_done(j, dirname);
+  if (++j->unsynced >= JOURNAL_SYNC_RECORDS || time(0) - j->lastsync >= JOURNAL_SYNC_SECONDS)
+    journal_sync(j);
+  pthread_mutex_unlock(&j->lock);
+} /*journal_record*/
+
+void journal_close(struct journal *j)
+{
+  size_t i;
+  journal_sync(j);
+  fclose(j->h);
+  for (i = 0; i <= j->donemask; i++)
+    free(j->done[i]);
+  free(j->done);
+  free(j->fname);
+  pthread_mutex_destroy(&j->lock);
+  free(j);
+} /*journal_close*/
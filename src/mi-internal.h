@@ -23,7 +23,12 @@
 #ifndef __DA_INTERNAL_H_
 #define __DA_INTERNAL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
 #include "common.h"
+#include "ifo-layout.h"
 
 
 enum {VR_NONE=0,VR_NTSCFILM=1,VR_FILM=2,VR_PAL=3,VR_NTSC=4,VR_30=5,VR_PALFIELD=6,VR_NTSCFIELD=7,VR_60=8}; /* values for videodesc.vframerate */
@@ -150,12 +155,12 @@ struct vobgroup { /* contents of a menuset or titleset (<menus> or <titles>) */
 };
 
 struct vtsdef { /* describes a VTS */
+    int vtsn; /* titleset number, nn in VTS_nn_0.IFO */
     bool hasmenu;
     int numtitles; /* length of numchapters array */
     int *numchapters; /* number of chapters in each title */
     int numsectors;
-    char vtssummary[0x300]; /* copy of VTS attributes (bytes 0x100 onwards of VTS IFO) */
-    char vtscat[4]; /* VTS_CAT (copy of bytes 0x22 .. 0x25 of VTS IFO) */
+    struct vtsi_mat mat; /* header of VTS IFO, kept for its VTS_CAT and attributes */
 };
 
 // keeps TT_SRPT within 1 sector
@@ -166,17 +171,60 @@ struct toc_summary {
     int numvts;
 };
 
+#define VMG_IMAGE_IOVS (5 + MAXVTS * 3)
+  /* header, TT_SRPT, VMG_VTS_ATRT header and offsets, 3 per VTS_ATRT, padding */
+
+struct vmg_image { /* a VMG IFO laid out in memory by TocGen, ready to be written out */
+    struct vmgi_header hdr;
+    unsigned char *tt_srpt; /* whole sectors */
+    struct vmg_vts_atrt_hdr atrthdr;
+    unsigned char offsets[MAXVTS * 4]; /* of each VTS_ATRT */
+    be4 atrtlast; /* end address, same for every VTS_ATRT */
+    struct iovec iov[VMG_IMAGE_IOVS]; /* all the pieces of the IFO, in order */
+    int niov;
+    unsigned int crc; /* CRC-32C of the whole IFO */
+};
+
 struct workset {
     const struct toc_summary *titlesets;
     const struct menugroup *menus;
     const struct pgcgroup *titles;
 };
 
+struct mkcat_header; /* defined in catalog.h */
+
+extern const char * const vmpegdesc[4];
+extern const char * const vresdesc[6];
+extern const char * const vformatdesc[4];
+extern const char * const vaspectdesc[4];
+extern const char * const vwidescreendesc[5];
+extern const char * const aformatdesc[6];
+extern const char * const aquantdesc[6];
+extern const char * const adolbydesc[3];
+extern const char * const alangdesc[4];
+extern const char * const achanneldesc[10];
+extern const char * const asampledesc[4];
+extern const char * const acontentdesc[6];
+
 void write4(unsigned char *p,unsigned int v);
 void write2(unsigned char *p,unsigned int v);
+unsigned int read4(const unsigned char *p);
 unsigned int read2(const unsigned char *p);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
 
 int getratedenom(const struct vobgroup *va);
-void TocGen(const struct workset *ws,const char *fname);
+void pgcgroup_pushci(struct pgcgroup *p, bool warn);
+struct vmg_image *TocGen(const struct workset *ws);
+bool vmg_image_write(const struct vmg_image *img, int dirfd, const char *fname);
+
+#define SCAN_ALIGN 4096 /* alignment of buffers for scan_pread */
+ssize_t scan_pread(int fd, void *buf, size_t len, off_t offset);
+
+const struct mkcat_header *catalog_map(const char *fname);
+void catalog_unmap(const struct mkcat_header *hdr);
+
+void vtsattr_decode_video(const unsigned char *v, struct videodesc *vd);
+void vtsattr_decode_audio(const unsigned char *a, struct audiodesc *ad);
+void vtsattr_decode_subpic(const unsigned char *s, struct subpicdesc *sd);
 
 #endif
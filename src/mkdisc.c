@@ -0,0 +1,115 @@
+/*
+    mkinfo -- writing synthetic DVD directories for "make check"
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+/*
+    mkdisc DIR NUMVTS SEED creates DIR/VIDEO_TS holding NUMVTS titlesets,
+    each with an IFO, an identical BUP and a small VOB, and no VMG. The IFO
+    headers are just complete enough for mkinfo to generate a VMG from;
+    SEED varies their sizes and attributes, so that different discs don't
+    all come out the same.
+*/
+
+#include "config.h"
+#include "compat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "mkinfo.h"
+#include "mi-internal.h"
+
+static void write_file(const char *dir, const char *name, const void *buf, size_t len)
+{
+  char path[PATH_MAX];
+  FILE *f;
+  snprintf(path, sizeof path, "%s/VIDEO_TS/%s", dir, name);
+  f = fopen(path, "wb");
+  if (!f || fwrite(buf, 1, len, f) != len || fclose(f) != 0)
+    {
+      fprintf(stderr, "ERR:  cannot write %s: %s\n", path, strerror(errno));
+      exit(1);
+    } /*if*/
+} /*write_file*/
+
+static void make_vts(const char *dir, int vtsn, int seed)
+/* writes the files of titleset vtsn, with vtsn + 1 titles. */
+{
+  unsigned char ifo[2 * DVD_SECTOR_SIZE];
+  static const unsigned char vob[3 * DVD_SECTOR_SIZE];
+  struct vtsi_mat * const mat = (struct vtsi_mat *)ifo;
+  unsigned char * const ptt = ifo + DVD_SECTOR_SIZE;
+  const int numtitles = vtsn + 1;
+  char name[13];
+  int i, offset;
+
+  memset(ifo, 0, sizeof ifo);
+  memcpy(mat->vts_id, "DVDVIDEO-VTS", 12);
+  write4(mat->vts_last_sector, 1000 * vtsn + seed - 1);
+  write4(mat->vtsi_last_sector, 1);
+  mat->version = 0x11;
+  write4(mat->vts_category, vtsn & 1);
+  write4(mat->vtsm_vobs_sector, vtsn % 2 ? 3 : 0);
+  write4(mat->vts_ptt_srpt_sector, 1);
+  for (i = 0; i < sizeof mat->vts_attrs; i++)
+    mat->vts_attrs[i] = (i * 7 + vtsn + seed) & 0xff;
+  mat->vts_attrs[0] = 0x01;
+  mat->vts_attrs[1] = 0x40;
+  /* VTS_PTT_SRPT, one chapter more in each title than the last */
+  write2(ptt, numtitles);
+  offset = 8 + numtitles * 4;
+  for (i = 0; i < numtitles; i++)
+    {
+      write4(ptt + 8 + i * 4, offset);
+      offset += 4 * (i + 2);
+    } /*for*/
+  write4(ptt + 4, offset - 1);
+  sprintf(name, "VTS_%02d_0.IFO", vtsn);
+  write_file(dir, name, ifo, sizeof ifo);
+  sprintf(name, "VTS_%02d_0.BUP", vtsn);
+  write_file(dir, name, ifo, sizeof ifo);
+  sprintf(name, "VTS_%02d_1.VOB", vtsn);
+  write_file(dir, name, vob, sizeof vob);
+} /*make_vts*/
+
+int main(int argc, char **argv)
+{
+  char path[PATH_MAX];
+  int numvts, seed, i;
+  if (argc != 4 || (numvts = atoi(argv[2])) < 1 || numvts > 99)
+    {
+      fprintf(stderr, "Usage: %s DIR NUMVTS SEED\n", argv[0]);
+      return 1;
+    } /*if*/
+  seed = atoi(argv[3]);
+  snprintf(path, sizeof path, "%s/VIDEO_TS", argv[1]);
+  if ((mkdir(argv[1], 0777) != 0 && errno != EEXIST) || (mkdir(path, 0777) != 0 && errno != EEXIST))
+    {
+      fprintf(stderr, "ERR:  cannot create %s: %s\n", path, strerror(errno));
+      return 1;
+    } /*if*/
+  for (i = 1; i <= numvts; i++)
+    make_vts(argv[1], i, seed);
+  return 0;
+} /*main*/
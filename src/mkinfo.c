@@ -25,12 +25,19 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <dirent.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include "mkinfo.h"
 #include "mi-internal.h"
+#include "ifo-layout.h"
 
 
 
@@ -40,11 +47,11 @@ bool allowallreg = false;
 
 /* video/audio/subpicture attribute keywords -- note they are all unique to allow
    xxx_ANY attribute setting to work */
-static const char * const vmpegdesc[4]={"","mpeg1","mpeg2",0};
-static const char * const vresdesc[6]={"","720xfull","704xfull","352xfull","352xhalf",0};
-static const char * const vformatdesc[4]={"","ntsc","pal",0};
-static const char * const vaspectdesc[4]={"","4:3","16:9",0};
-static const char * const vwidescreendesc[5]={"","noletterbox","nopanscan","crop",0};
+const char * const vmpegdesc[4]={"","mpeg1","mpeg2",0};
+const char * const vresdesc[6]={"","720xfull","704xfull","352xfull","352xhalf",0};
+const char * const vformatdesc[4]={"","ntsc","pal",0};
+const char * const vaspectdesc[4]={"","4:3","16:9",0};
+const char * const vwidescreendesc[5]={"","noletterbox","nopanscan","crop",0};
 // taken from mjpegtools, also GPL
 const static char * const vratedesc[16] = /* descriptions of frame-rate codes */
   {
@@ -66,15 +73,15 @@ const static char * const vratedesc[16] = /* descriptions of frame-rate codes */
     "0xe",
     "0xf"
   };
-static const char * const aformatdesc[6]={"","ac3","mp2","pcm","dts",0};
+const char * const aformatdesc[6]={"","ac3","mp2","pcm","dts",0};
 /* audio formats */
-static const char * const aquantdesc[6]={"","16bps","20bps","24bps","drc",0};
-static const char * const adolbydesc[3]={"","surround",0};
-static const char * const alangdesc[4]={"","nolang","lang",0};
-static const char * const achanneldesc[10]={"","1ch","2ch","3ch","4ch","5ch","6ch","7ch","8ch",0};
-static const char * const asampledesc[4]={"","48khz","96khz",0};
+const char * const aquantdesc[6]={"","16bps","20bps","24bps","drc",0};
+const char * const adolbydesc[3]={"","surround",0};
+const char * const alangdesc[4]={"","nolang","lang",0};
+const char * const achanneldesc[10]={"","1ch","2ch","3ch","4ch","5ch","6ch","7ch","8ch",0};
+const char * const asampledesc[4]={"","48khz","96khz",0};
 /* audio sample rates */
-static const char * const acontentdesc[6] =
+const char * const acontentdesc[6] =
   {"", "normal", "impaired", "comments1", "comments2", 0};
 /* audio content types */
 
@@ -116,9 +123,6 @@ bool delete_output_dir = false;
 static int getratecode(const struct vobgroup *va)
 /* returns the frame rate code if specified, else the default. */
 {
-  /* HACK */
-  default_video_format = VF_NTSC;
-
   if (va->vd.vframerate)
     return va->vd.vframerate;
   else if (va->vd.vformat || default_video_format)
@@ -180,51 +184,511 @@ unsigned int read2(const unsigned char *p)
 #define ATTRMATCH(a) (attr==0 || attr==(a))
 /* does the attribute code match either the specified value or the xxx_ANY value */
 
-static char *makevtsdir(const char *s)
-/* returns the full pathname of the VIDEO_TS subdirectory within s if non-NULL,
-   else returns NULL. */
+int scan_openat(int dirfd, const char *name, int flags)
+/* opens name in dirfd for reading the way scan_io says, falling back to a plain
+   open where the file or filesystem doesn't allow that. */
 {
-  static char fbuf[1000];
+  int fd = -1;
+  io_delay(IO_OPEN);
+  if (scan_io == SCAN_IO_DIRECT && !(flags & O_DIRECTORY))
+    {
+      fd = openat(dirfd, name, flags | O_DIRECT | O_NOATIME);
+      if (fd < 0 && errno == EPERM) /* O_NOATIME needs us to own the file */
+        fd = openat(dirfd, name, flags | O_DIRECT);
+      if (fd >= 0 || errno != EINVAL) /* EINVAL means no O_DIRECT here */
+        return fd;
+    } /*if*/
+  if (scan_io != SCAN_IO_CACHED)
+    {
+      fd = openat(dirfd, name, flags | O_NOATIME);
+      if (fd < 0 && errno == EPERM)
+        fd = openat(dirfd, name, flags);
+      if (fd >= 0 && !(flags & O_DIRECTORY))
+        /* no readahead, which would bring in pages scan_pread doesn't know to drop */
+        posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+      return fd;
+    } /*if*/
+  return openat(dirfd, name, flags);
+} /*scan_openat*/
 
-  if( !s )
-    return 0;
-  strcpy(fbuf,s);
-  strcat(fbuf,"/VIDEO_TS");
-  return strdup(fbuf);
-}
+ssize_t scan_pread(int fd, void *buf, size_t len, off_t offset)
+/* reads from a file opened with scan_openat into buf, which must be aligned to
+   SCAN_ALIGN if the file has O_DIRECT. Unless scan_io is SCAN_IO_CACHED, whatever
+   this brings into the page cache is dropped from it again, while what was already
+   there is left alone. */
+{
+  ssize_t n, cached = 0;
+  io_delay(IO_READ);
+  if (scan_io == SCAN_IO_CACHED)
+    return pread(fd, buf, len, offset);
+  if (fcntl(fd, F_GETFL) & O_DIRECT)
+    {
+      n = pread(fd, buf, len, offset);
+      if (n >= 0 || errno != EINVAL)
+        return n;
+      /* device needs bigger alignment than we can give, do without */
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    } /*if*/
+#if defined(HAVE_PREADV2) && defined(RWF_NOWAIT)
+    {
+      /* find out how much of it is already cached, without doing any I/O */
+      struct iovec iov;
+      iov.iov_base = buf;
+      iov.iov_len = len;
+      cached = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+      if (cached == (ssize_t)len)
+        return cached;
+      if (cached < 0)
+        cached = 0;
+    }
+#endif
+  n = pread(fd, buf, len, offset);
+  if (n > cached)
+    {
+      /* only whole pages are dropped, so round out to them; the first one
+         wasn't cached before, or cached would have included it */
+      const off_t pagesize = sysconf(_SC_PAGESIZE);
+      const off_t start = (offset + cached) / pagesize * pagesize;
+      const off_t end = (offset + n + pagesize - 1) / pagesize * pagesize;
+      posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+    } /*if*/
+  return n;
+} /*scan_pread*/
+
+#define WHYSIZE 80 /* room for a read_vts_ifo problem description */
 
-static void ScanIfo(struct toc_summary *ts, const char *ifo)
-/* scans another existing VTS IFO file and puts info about it
-   into *ts for inclusion in the VMG. */
+static bool read_header(int fd, void *bounce, void *dest, size_t len, off_t offset)
+/* reads len bytes at offset in fd into dest, by way of the sector-sized buffer
+   bounce if not NULL, returning false if they couldn't all be read. */
 {
-  static unsigned char buf[2048];
-  struct vtsdef *vd;
-  size_t dummy;
-  int i,first;
-  FILE * const h = fopen(ifo, "rb");
-  if (!h)
+  if (!bounce)
+    return scan_pread(fd, dest, len, offset) == (ssize_t)len;
+  if (scan_pread(fd, bounce, DVD_SECTOR_SIZE, offset) != DVD_SECTOR_SIZE)
+    return false;
+  memcpy(dest, bounce, len);
+  return true;
+} /*read_header*/
+
+static const char *read_vts_ifo
+  (
+    int dirfd,
+    const char *fname,
+    struct vtsi_mat *mat,
+    unsigned char *ptt,
+    char *why
+  )
+/* reads the header sector and the first sector of VTS_PTT_SRPT from the VTS IFO
+   (or BUP) fname in dirfd into mat and ptt, and checks that they are self-consistent.
+   Returns NULL if so, else a description of the problem, possibly in why, which
+   must have room for WHYSIZE bytes. */
+{
+  struct stat st;
+  const struct vts_ptt_srpt_hdr * const ptthdr = (const struct vts_ptt_srpt_hdr *)ptt;
+  unsigned int pttsector, numsectors, numtitles, lastbyte, prev, i;
+  const char *result = 0;
+  void *sector = 0; /* with O_DIRECT, whole sectors are read into here instead */
+  const int fd = scan_openat(dirfd, fname, O_RDONLY);
+  int err = fd < 0 ? errno : 0;
+
+  if (fd >= 0 && (fcntl(fd, F_GETFL) & O_DIRECT) != 0)
+    err = posix_memalign(&sector, SCAN_ALIGN, DVD_SECTOR_SIZE); /* doesn't set errno */
+  if (err != 0)
     {
-      fprintf(stderr, "ERR:  cannot open %s: %s\n", ifo, strerror(errno));
-      exit(1);
+      snprintf(why, WHYSIZE, "%s", strerror(err));
+      if (fd >= 0)
+        close(fd);
+      return why;
+    } /*if*/
+  do /*once*/
+    {
+      if (fstat(fd, &st) != 0 || !read_header(fd, sector, mat, sizeof *mat, 0))
+        {
+          result = "cannot read header";
+          break;
+        } /*if*/
+      if (memcmp(mat->vts_id, "DVDVIDEO-VTS", sizeof mat->vts_id) != 0)
+        {
+          result = "bad magic";
+          break;
+        } /*if*/
+      numsectors = st.st_size / DVD_SECTOR_SIZE;
+      pttsector = read4(mat->vts_ptt_srpt_sector);
+      if
+        (
+            read4(mat->vtsi_last_sector) >= numsectors
+        ||
+            pttsector == 0
+        ||
+            pttsector > read4(mat->vtsi_last_sector)
+        ||
+            read4(mat->vts_last_sector) < read4(mat->vtsi_last_sector)
+        )
+        {
+          result = "table pointers outside file";
+          break;
+        } /*if*/
+      if (!read_header(fd, sector, ptt, DVD_SECTOR_SIZE, (off_t)pttsector * DVD_SECTOR_SIZE))
+        {
+          result = "cannot read VTS_PTT_SRPT";
+          break;
+        } /*if*/
+      numtitles = read2(ptthdr->num_titles);
+      lastbyte = read4(ptthdr->last_byte);
+      if (numtitles < 1 || numtitles > 99)
+        {
+          snprintf(why, WHYSIZE, "implausible number of titles %u", numtitles);
+          result = why;
+          break;
+        } /*if*/
+      prev = sizeof(struct vts_ptt_srpt_hdr) + numtitles * 4;
+      for (i = 0; i < numtitles; i++)
+        {
+          const unsigned int offset = read4(ptt + sizeof(struct vts_ptt_srpt_hdr) + i * 4);
+          if (offset < prev || offset > lastbyte + 1)
+            break;
+          prev = offset;
+        } /*for*/
+      if (i < numtitles || lastbyte + 1 < prev)
+        result = "inconsistent VTS_PTT_SRPT";
+    }
+  while (false);
+  close(fd);
+  free(sector);
+  return result;
+} /*read_vts_ifo*/
+
+static void restore_twin(const char *vtsdir, int dirfd, const char *from, const char *to)
+/* replaces the damaged file to with a copy of from, both in dirfd, which is vtsdir. */
+{
+  char * const tmpname = malloc(strlen(to) + 5);
+  struct stat st;
+  off_t left;
+  int in, out = -1;
+
+  sprintf(tmpname, "%s.tmp", to);
+  io_delay(IO_OPEN);
+  in = openat(dirfd, from, O_RDONLY);
+  if (in >= 0 && fstat(in, &st) == 0)
+    {
+      io_delay(IO_OPEN);
+      out = openat(dirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    } /*if*/
+  for (left = out >= 0 ? st.st_size : -1; left > 0;)
+    {
+      io_delay(IO_WRITE);
+#ifdef HAVE_COPY_FILE_RANGE
+      ssize_t n = copy_file_range(in, 0, out, 0, left, 0);
+      if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL))
+#else
+      ssize_t n = -1;
+#endif
+        {
+          /* plain copy if the kernel or filesystem can't do it */
+          char buf[65536];
+          n = read(in, buf, sizeof buf);
+          if (n > 0 && write(out, buf, n) != n)
+            n = -1;
+        } /*if*/
+      if (n <= 0)
+        break;
+      left -= n;
+    } /*for*/
+  io_delay(IO_FSYNC);
+  if (out < 0 || left != 0 || fsync(out) != 0 || close(out) != 0 || renameat(dirfd, tmpname, dirfd, to) != 0)
+    {
+      fprintf(stderr, "WARN: could not restore %s/%s from %s: %s\n", vtsdir, to, from, strerror(errno));
+      unlinkat(dirfd, tmpname, 0);
+    }
+  else
+    fprintf(stderr, "INFO: Restored %s/%s from %s\n", vtsdir, to, from);
+  if (in >= 0)
+    close(in);
+  free(tmpname);
+} /*restore_twin*/
+
+#define HEDGE_WINDOW 256 /* how many recent VTS IFO header read times to go by */
+#define HEDGE_MIN_SAMPLES 16 /* no hedging until this many are known */
+
+static struct
+  {
+    pthread_mutex_t lock;
+    double times[HEDGE_WINDOW]; /* recent read times in seconds, oldest overwritten first */
+    unsigned long count; /* total recorded */
+    struct hedge_stats stats;
+  } readtimes = {PTHREAD_MUTEX_INITIALIZER};
+
+struct hedge;
+
+struct hedged_read { /* one of the two reads raced by read_vts_hedged */
+    struct hedge *hedge;
+    char *fname;
+    struct vtsi_mat mat;
+    unsigned char ptt[DVD_SECTOR_SIZE];
+    char whybuf[WHYSIZE];
+    const char *why; /* result from read_vts_ifo, if finished */
+    bool finished;
+};
+
+struct hedge { /* shared between read_vts_hedged and its reader threads */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int refs; /* freed when the last of these lets go, since a loser may outlast the race */
+    int dirfd; /* own copy, for the same reason */
+    struct hedged_read reads[2]; /* IFO, then BUP */
+};
+
+static void note_read_time(double elapsed)
+{
+  pthread_mutex_lock(&readtimes.lock);
+  readtimes.times[readtimes.count++ % HEDGE_WINDOW] = elapsed;
+  pthread_mutex_unlock(&readtimes.lock);
+} /*note_read_time*/
+
+static void count_hedge(unsigned long *counter)
+{
+  pthread_mutex_lock(&readtimes.lock);
+  ++*counter;
+  pthread_mutex_unlock(&readtimes.lock);
+} /*count_hedge*/
+
+void hedge_stats_get(struct hedge_stats *stats)
+/* returns how hedging has gone in this process so far. */
+{
+  pthread_mutex_lock(&readtimes.lock);
+  *stats = readtimes.stats;
+  pthread_mutex_unlock(&readtimes.lock);
+} /*hedge_stats_get*/
+
+static int compare_times(const void *a, const void *b)
+{
+  const double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+} /*compare_times*/
+
+static double hedge_threshold(void)
+/* returns how long to give a VTS IFO header read before trying the BUP as well: the
+   hedge_percentile'th percentile of recent read times, or -1 if too few are known. */
+{
+  double sorted[HEDGE_WINDOW];
+  size_t n, i;
+  pthread_mutex_lock(&readtimes.lock);
+  n = readtimes.count < HEDGE_WINDOW ? readtimes.count : HEDGE_WINDOW;
+  memcpy(sorted, readtimes.times, n * sizeof(double));
+  pthread_mutex_unlock(&readtimes.lock);
+  if (n < HEDGE_MIN_SAMPLES)
+    return -1;
+  qsort(sorted, n, sizeof(double), compare_times);
+  i = (n * hedge_percentile + 99) / 100;
+  return sorted[i ? i - 1 : 0];
+} /*hedge_threshold*/
+
+static void hedge_release(struct hedge *h)
+/* lets go of h, which must be locked, freeing it if nothing else still needs it. */
+{
+  const bool last = --h->refs == 0;
+  int i;
+  pthread_mutex_unlock(&h->lock);
+  if (!last)
+    return;
+  for (i = 0; i < 2; i++)
+    free(h->reads[i].fname);
+  close(h->dirfd);
+  pthread_cond_destroy(&h->changed);
+  pthread_mutex_destroy(&h->lock);
+  free(h);
+} /*hedge_release*/
+
+static void *hedge_reader(void *arg)
+/* thread doing one of the reads in a hedge. */
+{
+  struct hedged_read * const r = arg;
+  struct hedge * const h = r->hedge;
+  const double started = monotime();
+  const char * const why = read_vts_ifo(h->dirfd, r->fname, &r->mat, r->ptt, r->whybuf);
+  if (r == &h->reads[0])
+    /* all IFO reads count, including those that lose, or the slow ones would be missed */
+    note_read_time(monotime() - started);
+  pthread_mutex_lock(&h->lock);
+  r->why = why;
+  r->finished = true;
+  pthread_cond_signal(&h->changed);
+  hedge_release(h);
+  return 0;
+} /*hedge_reader*/
+
+static bool hedge_start(struct hedge *h, int which)
+/* starts a thread doing reads[which] of h, which must be locked. */
+{
+  pthread_t thread;
+  h->refs++;
+  if (pthread_create(&thread, 0, hedge_reader, &h->reads[which]) != 0)
+    {
+      h->refs--;
+      return false;
+    } /*if*/
+  pthread_detach(thread);
+  return true;
+} /*hedge_start*/
+
+static const char *read_vts_hedged
+  (
+    int dirfd,
+    const char *ifo,
+    const char *bup,
+    struct vtsi_mat *mat,
+    unsigned char *ptt,
+    char *why,
+    bool *usedbup
+  )
+/* does the same as read_vts_ifo on ifo, except that if that takes longer than
+   hedge_threshold, the same is read from bup as well, and whichever is first to be
+   read and found to be in order is used. Returns the problem with ifo if it turned
+   out to have one before that, else NULL. *usedbup says whether what was read came
+   from bup; if ifo has a problem and not, the caller can fall back to bup as usual. */
+{
+  const double threshold = hedge_threshold();
+  struct hedge *h;
+  pthread_condattr_t attr;
+  struct timespec deadline;
+  const char *result = 0;
+  const struct hedged_read *winner = 0;
+  bool hedged = false, bupstarted = false;
+  int i;
+
+  *usedbup = false;
+  count_hedge(&readtimes.stats.reads);
+  if (threshold < 0 || (h = calloc(1, sizeof(struct hedge))) == 0)
+    {
+      /* still finding out how long reads take */
+      const double started = monotime();
+      result = read_vts_ifo(dirfd, ifo, mat, ptt, why);
+      note_read_time(monotime() - started);
+      return result;
+    } /*if*/
+  pthread_mutex_init(&h->lock, 0);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&h->changed, &attr);
+  pthread_condattr_destroy(&attr);
+  h->refs = 1;
+  h->dirfd = dup(dirfd);
+  h->reads[0].fname = strdup(ifo);
+  h->reads[1].fname = strdup(bup);
+  for (i = 0; i < 2; i++)
+    h->reads[i].hedge = h;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += (time_t)threshold;
+  deadline.tv_nsec += (long)((threshold - (time_t)threshold) * 1e9);
+  if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    } /*if*/
+
+  pthread_mutex_lock(&h->lock);
+  if (h->dirfd < 0 || !hedge_start(h, 0))
+    {
+      hedge_release(h);
+      return read_vts_ifo(dirfd, ifo, mat, ptt, why);
+    } /*if*/
+  for (;;)
+    {
+      if (h->reads[0].finished && !h->reads[0].why)
+        {
+          winner = &h->reads[0];
+          break;
+        } /*if*/
+      if (bupstarted && h->reads[1].finished && !h->reads[1].why)
+        {
+          winner = &h->reads[1];
+          *usedbup = true;
+          count_hedge(&readtimes.stats.won);
+          break;
+        } /*if*/
+      if (h->reads[0].finished && (!bupstarted || h->reads[1].finished))
+        break; /* no good copy to be had here */
+      if (hedged)
+        pthread_cond_wait(&h->changed, &h->lock);
+      else if (pthread_cond_timedwait(&h->changed, &h->lock, &deadline) == ETIMEDOUT)
+        {
+          hedged = true;
+          bupstarted = hedge_start(h, 1); /* if it can't be, just keep waiting for the IFO */
+          if (bupstarted)
+            count_hedge(&readtimes.stats.hedged);
+        } /*if*/
+    } /*for*/
+  if (h->reads[0].finished && h->reads[0].why)
+    {
+      /* still to be reported, even if the BUP has stepped in */
+      snprintf(why, WHYSIZE, "%s", h->reads[0].why);
+      result = why;
+    } /*if*/
+  if (winner)
+    {
+      memcpy(mat, &winner->mat, sizeof *mat);
+      memcpy(ptt, winner->ptt, DVD_SECTOR_SIZE);
     } /*if*/
+  hedge_release(h);
+  return result;
+} /*read_vts_hedged*/
+
+static bool ScanIfo(struct toc_summary *ts, const char *vtsdir, int dirfd, const char *ifo, int vtsn)
+/* scans another existing VTS IFO file ifo in dirfd (which is vtsdir) for titleset
+   number vtsn and puts info about it into *ts for inclusion in the VMG. If the IFO
+   is unreadable or damaged, its BUP copy is used instead; returns false if that
+   is no good either. */
+{
+  unsigned char buf[DVD_SECTOR_SIZE];
+  char whybuf[WHYSIZE];
+  struct vtsdef *vd;
+  int i,first;
+  const char *why;
+  char * const bup = strdup(ifo); /* backup copy: same name, with extension BUP in the same case */
+  const size_t len = strlen(bup);
+  bool usedbup = false;
+
+  memcpy(bup + len - 3, bup[len - 1] == 'o' ? "bup" : "BUP", 3);
   if (ts->numvts + 1 >= MAXVTS)
     {
       /* shouldn't occur */
       fprintf(stderr,"ERR:  Too many VTSs\n");
       exit(1);
     } /*if*/
-  dummy = fread(buf, 1, 2048, h);
+  fprintf(stderr, "INFO: Scanning %s/%s\n", vtsdir, ifo);
   vd = &ts->vts[ts->numvts]; /* where to put new entry */
-  if (read4(buf + 0xc0) != 0) /* start sector of menu VOB */
+  /* header goes straight into the entry, where it stays for TocGen to write out */
+  why =
+      hedge_percentile
+    ?
+      read_vts_hedged(dirfd, ifo, bup, &vd->mat, buf, whybuf, &usedbup)
+    :
+      read_vts_ifo(dirfd, ifo, &vd->mat, buf, whybuf);
+  if (why)
+    {
+      /* try the backup copy, unless hedging has already got it */
+      char * const whyifo = strdup(why);
+      why = usedbup ? 0 : read_vts_ifo(dirfd, bup, &vd->mat, buf, whybuf);
+      if (why)
+        {
+          fprintf(stderr, "ERR:  %s/%s: %s, and %s: %s\n", vtsdir, ifo, whyifo, bup, why);
+          free(whyifo);
+          free(bup);
+          return false;
+        } /*if*/
+      fprintf(stderr, "WARN: %s/%s: %s, using %s\n", vtsdir, ifo, whyifo, bup);
+      if (repair_ifo)
+        restore_twin(vtsdir, dirfd, bup, ifo);
+      free(whyifo);
+    } /*if*/
+  free(bup);
+  vd->vtsn = vtsn;
+  if (read4(vd->mat.vtsm_vobs_sector) != 0) /* start sector of menu VOB */
     vd->hasmenu = true;
   else
     vd->hasmenu = false;
-  vd->numsectors = read4(buf + 0xc) + 1; /* last sector of title set (last sector of BUP) */
-  memcpy(vd->vtscat, buf + 0x22, 4); /* VTS category */
-  memcpy(vd->vtssummary, buf + 0x100, 0x300); /* attributes of streams in VTS and VTSM */
-  dummy = fread(buf, 1, 2048, h); // VTS_PTT_SRPT is 2nd sector
-  // we only need to read the 1st sector of it because we only need the
-  // pgc pointers
+  vd->numsectors = read4(vd->mat.vts_last_sector) + 1; /* last sector of title set (last sector of BUP) */
+  // buf holds the 1st sector of VTS_PTT_SRPT; we only need that much of it
+  // because we only need the pgc pointers
   vd->numtitles = read2(buf); /* nr titles */
   vd->numchapters = (int *)malloc(sizeof(int) * vd->numtitles);
   /* array of nr chapters in each title */
@@ -237,8 +701,8 @@ static void ScanIfo(struct toc_summary *ts, const char *ifo)
     } /*for*/
   vd->numchapters[i] = (read4(buf + 4) /* end address (last byte of last VTS_PTT) */ + 1 - first) / 4;
   /* nr chapters for last title */
-  fclose(h);
   ts->numvts++;
+  return true;
 } /*ScanIfo*/
 
 static void forceaddentry(struct pgcgroup *va, int entry)
@@ -255,32 +719,68 @@ static void forceaddentry(struct pgcgroup *va, int entry)
     } /*if*/
 } /*forceaddentry*/
 
-static void initdir(const char * fbase)
-/* creates the top-level DVD-video subdirectories within the output directory,
-   if they don't already exist. */
+static int mkdirfd(int dirfd, const char *name, const char *path)
+/* opens the subdirectory name of dirfd, creating it if it doesn't exist. path
+   is the full name of the subdirectory, for error messages. Returns -1 if it
+   can't be done. */
 {
-  static char realfbase[1000];
-  if (fbase)
+  int fd;
+  io_delay(IO_OPEN);
+  if (mkdirat(dirfd, name, 0777) && errno != EEXIST)
     {
-      if (mkdir(fbase, 0777) && errno != EEXIST)
-        {
-          fprintf(stderr, "ERR:  cannot create dir %s: %s\n", fbase, strerror(errno));
-          exit(1);
-        } /*if*/
-      snprintf(realfbase, sizeof realfbase, "%s/VIDEO_TS", fbase);
-      if (mkdir(realfbase, 0777) && errno != EEXIST)
-        {
-          fprintf(stderr, "ERR:  cannot create dir %s: %s\n", realfbase, strerror(errno));
-          exit(1);
-        } /*if*/
-      snprintf(realfbase, sizeof realfbase, "%s/AUDIO_TS", fbase);
-      if (mkdir(realfbase, 0777) && errno != EEXIST)
+      fprintf(stderr, "ERR:  cannot create dir %s: %s\n", path, strerror(errno));
+      return -1;
+    } /*if*/
+  fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    fprintf(stderr, "ERR:  cannot open dir %s: %s\n", path, strerror(errno));
+  return fd;
+} /*mkdirfd*/
+
+static int initdir(const char *fbase)
+/* creates the output directory, as for "mkdir -p", and the top-level DVD-video
+   subdirectories within it, if they don't already exist. Returns a descriptor
+   for its VIDEO_TS subdirectory, or -1 if something couldn't be created. The
+   directories are created one component at a time relative to the previous one,
+   so there is no limit on the length of fbase. */
+{
+  char *p = strdup(fbase);
+  char *s, *component;
+  int dirfd, fd;
+
+  dirfd = open(p[0] == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY);
+  if (dirfd < 0)
+    fprintf(stderr, "ERR:  cannot open dir %s: %s\n", p[0] == '/' ? "/" : ".", strerror(errno));
+  for (component = p; component && dirfd >= 0; component = s)
+    {
+      s = strchr(component, '/');
+      if (s)
+        *s = 0;
+      if (*component)
         {
-          fprintf(stderr, "ERR:  cannot create dir %s: %s\n", realfbase, strerror(errno));
-          exit(1);
+          fd = mkdirfd(dirfd, component, p);
+          close(dirfd);
+          dirfd = fd;
         } /*if*/
+      if (s)
+        *s++ = '/';
+    } /*for*/
+  free(p);
+  if (dirfd < 0)
+    return -1;
+  p = malloc(strlen(fbase) + 10); /* for messages */
+  sprintf(p, "%s/AUDIO_TS", fbase);
+  fd = mkdirfd(dirfd, "AUDIO_TS", p);
+  if (fd >= 0)
+    {
+      close(fd);
+      sprintf(p, "%s/VIDEO_TS", fbase);
+      fd = mkdirfd(dirfd, "VIDEO_TS", p);
     } /*if*/
+  close(dirfd);
+  free(p);
   errno = 0;
+  return fd;
 } /*initdir*/
 
 static struct vobgroup *vobgroup_new()
@@ -290,39 +790,109 @@ static struct vobgroup *vobgroup_new()
   return vg;
 }
 
-static void pgcgroup_pushci(struct pgcgroup *p, bool warn)
+struct vobusers { /* entry in hash table built by pgcgroup_pushci */
+    const struct vob *vob; /* key, NULL if slot unused */
+    int first; /* index into uses array of first PGC using this vob */
+    struct colorinfo *pushed; /* colour table shared among all users, NULL if not yet */
+    bool mixed; /* some users already had a different colour table */
+};
+
+static struct vobusers *vobusers_slot(struct vobusers *tab, size_t mask, const struct vob *v)
+/* returns the slot in tab for v: either the one already holding it, or the empty
+   one where it should go. tab has mask + 1 entries, a power of 2, and is never full. */
+{
+  size_t h = (size_t)((uintptr_t)v >> 4) * 0x9e3779b1u;
+  for (;;)
+    {
+      struct vobusers * const e = tab + (h & mask);
+      if (!e->vob || e->vob == v)
+        return e;
+      h++;
+    } /*for*/
+} /*vobusers_slot*/
+
+void pgcgroup_pushci(struct pgcgroup *p, bool warn)
 /* shares colorinfo structures among all pgc elements that have sources
    which were allocated the same vob structures. */
 {
-  int i, j, ii, jj;
+  struct use {
+    int pgc; /* index of PGC */
+    int next; /* index of next use of same vob, -1 if none */
+  } *uses;
+  struct vobusers *tab, *e;
+  size_t mask, n;
+  int i, j, k;
+
+  n = 0;
+  for (i = 0; i < p->numpgcs; i++)
+    n += p->pgcs[i]->numsources;
+  for (mask = 15; mask < n * 2; mask = mask * 2 + 1)
+    /* keep load factor at most 1/2 */;
+  tab = calloc(mask + 1, sizeof(struct vobusers));
+  uses = malloc((n + 1) * sizeof(struct use));
+  if (!tab || !uses)
+    {
+      fprintf(stderr, "ERR:  pgcgroup_pushci: out of memory\n");
+      exit(1);
+    } /*if*/
+  /* collect the list of uses of each vob, in order of PGC and source, by
+     going backwards and adding each one to the front */
+  for (i = p->numpgcs; --i >= 0;)
+    for (j = p->pgcs[i]->numsources; --j >= 0;)
+      {
+        e = vobusers_slot(tab, mask, p->pgcs[i]->sources[j]->vob);
+        if (!e->vob)
+          {
+            e->vob = p->pgcs[i]->sources[j]->vob;
+            e->first = -1;
+          } /*if*/
+        n--;
+        uses[n].pgc = i;
+        uses[n].next = e->first;
+        e->first = n;
+      } /*for; for*/
+  /* each PGC with a colour table (including ones given one by an earlier PGC)
+     gives it to all other users of each of its vobs that don't have one yet,
+     warning about every use of the vob with a different one. Once a vob has
+     been done, every user has a colour table, so going through it again only
+     matters if that could produce a warning. */
   for (i = 0; i < p->numpgcs; i++)
     {
-      if (!p->pgcs[i]->colors)
+      struct colorinfo * const ci = p->pgcs[i]->colors;
+      if (!ci)
         continue;
       for (j = 0; j < p->pgcs[i]->numsources; j++)
         {
-          const struct vob * const v = p->pgcs[i]->sources[j]->vob;
-          for (ii = 0; ii < p->numpgcs; ii++)
-            for (jj = 0; jj < p->pgcs[ii]->numsources; jj++)
-              if (v == p->pgcs[ii]->sources[jj]->vob)
+          e = vobusers_slot(tab, mask, p->pgcs[i]->sources[j]->vob);
+          if (e->pushed && (!warn || (e->pushed == ci && !e->mixed)))
+            continue;
+          for (k = e->first; k >= 0; k = uses[k].next)
+            {
+              struct pgc * const user = p->pgcs[uses[k].pgc];
+              if (!user->colors)
+                {
+                  user->colors = ci;
+                  ci->refcount++;
+                }
+              else if (user->colors != ci)
                 {
-                  if (!p->pgcs[ii]->colors)
-                    {
-                      p->pgcs[ii]->colors = p->pgcs[i]->colors;
-                      p->pgcs[ii]->colors->refcount++;
-                    }
-                  else if (p->pgcs[ii]->colors != p->pgcs[i]->colors && warn)
-                    {
-                      fprintf
-                        (
-                         stderr,
-                         "WARN: Conflict in colormap between PGC %d and %d\n",
-                         i, ii
-                         );
-                    } /*if*/
-                } /*if; for; for*/
+                  if (!e->pushed)
+                    e->mixed = true;
+                  if (warn)
+                    fprintf
+                      (
+                       stderr,
+                       "WARN: Conflict in colormap between PGC %d and %d\n",
+                       i, uses[k].pgc
+                      );
+                } /*if*/
+            } /*for*/
+          if (!e->pushed)
+            e->pushed = ci;
         } /*for*/
     } /*for*/
+  free(uses);
+  free(tab);
 } /*pgcgroup_pushci*/
 
 static void pgcgroup_createvobs(struct pgcgroup *p, struct vobgroup *v)
@@ -426,6 +996,35 @@ struct menugroup *menugroup_new()
   return mg;
 }
 
+static void vobgroup_free(struct vobgroup *vg)
+{
+  free(vg->allpgcs);
+  free(vg->vobs);
+  free(vg);
+} /*vobgroup_free*/
+
+static void pgcgroup_free(struct pgcgroup *pg)
+/* nothing here creates PGCs, so there is only the array of them to free. */
+{
+  free(pg->pgcs);
+  if (pg->vg)
+    vobgroup_free(pg->vg);
+  free(pg);
+} /*pgcgroup_free*/
+
+void menugroup_free(struct menugroup *mg)
+/* frees mg along with all the pgcgroups added to it. */
+{
+  int i;
+  if (!mg)
+    return;
+  for (i = 0; i < mg->numgroups; i++)
+    pgcgroup_free(mg->groups[i].pg);
+  free(mg->groups);
+  vobgroup_free(mg->vg);
+  free(mg);
+} /*menugroup_free*/
+
 void menugroup_add_pgcgroup(struct menugroup *mg, const char *lang, struct pgcgroup *pg)
 {
   mg->groups = (struct langgroup *)realloc(mg->groups, (mg->numgroups + 1) * sizeof(struct langgroup));
@@ -442,38 +1041,37 @@ void menugroup_add_pgcgroup(struct menugroup *mg, const char *lang, struct pgcgr
   mg->numgroups++;
 } /*menugroup_add_pgcgroup*/
 
-void dvdauthor_vmgm_gen(struct menugroup *menus, const char *fbase)
-/* generates a VMG, taking into account all already-generated titlesets. */
+struct toc_summary *toc_summary_scan(const char *fbase)
+/* collects info about all the existing titlesets in fbase, for inclusion in a new VMG.
+   Returns NULL if there are none. */
 {
   DIR *d;
   struct dirent *de;
   char *vtsdir;
-  int i;
-  static struct toc_summary ts; /* static avoids having to initialize it! */
-  static char fbuf[1000];
-  static char ifonames[101][14];
-  struct workset ws;
+  int i, dirfd;
+  struct toc_summary *ts;
+  char ifonames[101][14];
+  bool ok = true;
 
-  if (!fbase) // can't really make a vmgm without titlesets
-    return;
-  ws.titlesets = &ts;
-  ws.menus = menus;
-  ws.titles = 0;
-  for (i = 0; i < menus->numgroups; i++)
-    {
-      validatesummary(menus->groups[i].pg);
-      pgcgroup_createvobs(menus->groups[i].pg, menus->vg);
-      forceaddentry(menus->groups[i].pg, 4); /* entry=title */
-    } /*for*/
-  fprintf(stderr, "INFO: dvdauthor creating table of contents\n");
-  initdir(fbase);
-  // create base entry, if not already existing
-  memset(&ts, 0, sizeof(struct toc_summary));
-  vtsdir = makevtsdir(fbase);
+  ts = calloc(1, sizeof(struct toc_summary));
+  vtsdir = malloc(strlen(fbase) + 10);
+  sprintf(vtsdir, "%s/VIDEO_TS", fbase);
   for (i = 0; i < 101; i++)
     ifonames[i][0] = 0; /* mark all name entries as unused */
-  d = opendir(vtsdir);
-  while ((de = readdir(d)) != 0)
+  /* all further access is relative to this, so the path is only looked up once */
+  dirfd = scan_openat(AT_FDCWD, vtsdir, O_RDONLY | O_DIRECTORY);
+  d = dirfd >= 0 ? fdopendir(dup(dirfd)) : 0;
+  if (!d)
+    {
+      fprintf(stderr, "ERR:  cannot open %s: %s\n", vtsdir, strerror(errno));
+      if (dirfd >= 0)
+        close(dirfd);
+      free(vtsdir);
+      free(ts);
+      return 0;
+    } /*if*/
+  io_delay(IO_READDIR);
+  while (ok && (de = readdir(d)) != 0)
     {
       /* look for existing titlesets */
       i = strlen(de->d_name);
@@ -492,40 +1090,215 @@ void dvdauthor_vmgm_gen(struct menugroup *menus, const char *fbase)
             {
               fprintf(stderr, "ERR:  Two different names for the same titleset: %s and %s\n",
                       ifonames[i], de->d_name);
-              exit(1);
-            } /*if*/
-          if (!i)
+              ok = false;
+            }
+          else if (!i)
             {
               fprintf(stderr,"ERR:  Cannot have titleset #0 (%s)\n", de->d_name);
-              exit(1);
-            } /*if*/
-          strcpy(ifonames[i], de->d_name);
+              ok = false;
+            }
+          else
+            strcpy(ifonames[i], de->d_name);
         } /*if*/
     } /*while*/
   closedir(d);
-  for (i = 1; i <= 99; i++)
+  for (i = 1; ok && i <= 99; i++)
     {
       if (!ifonames[i][0])
         continue;
-      snprintf(fbuf, sizeof fbuf, "%s/%s", vtsdir, ifonames[i]);
-      fprintf(stderr, "INFO: Scanning %s\n",fbuf);
-      ScanIfo(&ts, fbuf); /* collect info about existing titleset for inclusion in new VMG IFO */
+      ok = ScanIfo(ts, vtsdir, dirfd, ifonames[i], i);
+      /* collect info about existing titleset for inclusion in new VMG IFO */
     } /*for*/
-  if (!ts.numvts)
+  close(dirfd);
+  free(vtsdir);
+  if (!ok)
     {
-      fprintf(stderr, "ERR:  No .IFO files to process\n");
-      exit(1);
+      toc_summary_free(ts);
+      return 0;
     } /*if*/
+  if (!ts->numvts)
+    {
+      fprintf(stderr, "ERR:  No .IFO files to process in %s\n", fbase);
+      free(ts);
+      return 0;
+    } /*if*/
+  return ts;
+} /*toc_summary_scan*/
 
+void toc_summary_free(struct toc_summary *ts)
+{
+  int i;
+  if (!ts)
+    return;
+  for (i = 0; i < ts->numvts; i++)
+    if (ts->vts[i].numchapters)
+      free(ts->vts[i].numchapters);
+  free(ts);
+} /*toc_summary_free*/
 
-  /* (re)generate VMG IFO */
-  snprintf(fbuf, sizeof fbuf, "%s/VIDEO_TS.IFO", vtsdir);
-  TocGen(&ws, fbuf);
-  snprintf(fbuf, sizeof fbuf, "%s/VIDEO_TS.BUP", vtsdir); /* same thing again, backup copy */
-  TocGen(&ws, fbuf);
-  for (i = 0; i < ts.numvts; i++)
-    if (ts.vts[i].numchapters)
-      free(ts.vts[i].numchapters);
-  free(vtsdir);
-} /*dvdauthor_vmgm_gen*/
+double monotime(void)
+/* returns the current time in seconds on a clock that doesn't jump. */
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+} /*monotime*/
+
+void *toc_summary_pack(const struct toc_summary *ts, size_t *len)
+/* flattens ts into a single malloc'ed buffer, for passing between processes. */
+{
+  unsigned char *buf, *p;
+  int i;
+  *len = sizeof(int);
+  for (i = 0; i < ts->numvts; i++)
+    *len += sizeof(struct vtsdef) + ts->vts[i].numtitles * sizeof(int);
+  buf = p = malloc(*len);
+  memcpy(p, &ts->numvts, sizeof(int));
+  p += sizeof(int);
+  for (i = 0; i < ts->numvts; i++)
+    {
+      memcpy(p, &ts->vts[i], sizeof(struct vtsdef));
+      p += sizeof(struct vtsdef);
+      memcpy(p, ts->vts[i].numchapters, ts->vts[i].numtitles * sizeof(int));
+      p += ts->vts[i].numtitles * sizeof(int);
+    } /*for*/
+  return buf;
+} /*toc_summary_pack*/
 
+struct toc_summary *toc_summary_unpack(const void *buf, size_t len)
+/* reconstructs a toc_summary packed by toc_summary_pack. Returns NULL if buf
+   is truncated or otherwise doesn't make sense. */
+{
+  const unsigned char *p = buf, * const end = p + len;
+  struct toc_summary * const ts = calloc(1, sizeof(struct toc_summary));
+  int i, numvts;
+  if (len < sizeof(int))
+    goto bad;
+  memcpy(&numvts, p, sizeof(int));
+  p += sizeof(int);
+  if (numvts < 1 || numvts > MAXVTS)
+    goto bad;
+  for (i = 0; i < numvts; i++)
+    {
+      struct vtsdef * const vd = &ts->vts[i];
+      if (end - p < (ptrdiff_t)sizeof(struct vtsdef))
+        goto bad;
+      memcpy(vd, p, sizeof(struct vtsdef));
+      p += sizeof(struct vtsdef);
+      vd->numchapters = 0;
+      ts->numvts = i + 1; /* so toc_summary_free frees the right number */
+      if (vd->numtitles < 0 || (end - p) / sizeof(int) < (size_t)vd->numtitles)
+        goto bad;
+      vd->numchapters = malloc(vd->numtitles * sizeof(int) + 1);
+      memcpy(vd->numchapters, p, vd->numtitles * sizeof(int));
+      p += vd->numtitles * sizeof(int);
+    } /*for*/
+  if (p != end)
+    goto bad;
+  return ts;
+bad:
+  toc_summary_free(ts);
+  return 0;
+} /*toc_summary_unpack*/
+
+static void put_in_place(const char *vtsdir, int dirfd, const char *fname, bool *ok)
+/* renames fname.tmp in dirfd (which is vtsdir) to fname if everything has gone well
+   so far, otherwise gets rid of it. */
+{
+  char tmpname[20];
+  snprintf(tmpname, sizeof tmpname, "%s.tmp", fname);
+  if (*ok)
+    io_delay(IO_WRITE);
+  if (*ok && renameat(dirfd, tmpname, dirfd, fname) != 0)
+    {
+      fprintf(stderr, "ERR:  cannot rename %s/%s to %s: %s\n", vtsdir, tmpname, fname, strerror(errno));
+      *ok = false;
+    } /*if*/
+  if (!*ok)
+    unlinkat(dirfd, tmpname, 0);
+} /*put_in_place*/
+
+struct vmg_image *dvdauthor_vmgm_layout(struct menugroup *menus, const struct toc_summary *ts)
+/* lays out a VMG in memory, taking into account all already-generated titlesets
+   previously collected by toc_summary_scan, which must be kept until the VMG has
+   been written out by dvdauthor_vmgm_write. */
+{
+  int i;
+  struct workset ws;
+
+  ws.titlesets = ts;
+  ws.menus = menus;
+  ws.titles = 0;
+  for (i = 0; i < menus->numgroups; i++)
+    {
+      validatesummary(menus->groups[i].pg);
+      pgcgroup_createvobs(menus->groups[i].pg, menus->vg);
+      forceaddentry(menus->groups[i].pg, 4); /* entry=title */
+    } /*for*/
+  fprintf(stderr, "INFO: dvdauthor creating table of contents\n");
+  return TocGen(&ws);
+} /*dvdauthor_vmgm_layout*/
+
+bool dvdauthor_vmgm_write(const struct vmg_image *img, const char *outbase, unsigned int *outcrc)
+/* writes out the VMG IFO and BUP laid out by dvdauthor_vmgm_layout in outbase,
+   which may be a different directory from the one the titlesets were scanned in.
+   Sets *outcrc to the CRC-32C of the new VIDEO_TS.IFO. The files are written under
+   temporary names and only put in place once complete and on disk, and only if
+   job_deadline hasn't passed; returns false if they weren't, or if the renames
+   couldn't be made durable, so that nothing is journalled as done that a crash
+   could still undo. */
+{
+  char *outvtsdir;
+  int dirfd;
+  bool ok;
+
+  *outcrc = 0;
+  dirfd = initdir(outbase);
+  if (dirfd < 0)
+    return false;
+  outvtsdir = malloc(strlen(outbase) + 10); /* for messages */
+  sprintf(outvtsdir, "%s/VIDEO_TS", outbase);
+  ok =
+        vmg_image_write(img, dirfd, "VIDEO_TS.IFO.tmp")
+    &&
+        vmg_image_write(img, dirfd, "VIDEO_TS.BUP.tmp"); /* same thing again, backup copy */
+  if (ok && job_deadline != 0 && monotime() >= job_deadline)
+    {
+      fprintf(stderr, "ERR:  deadline passed, discarding VMG for %s\n", outbase);
+      ok = false;
+    } /*if*/
+  if (ok)
+    *outcrc = img->crc;
+  /* BUP first, so the IFO only appears once everything is there */
+  put_in_place(outvtsdir, dirfd, "VIDEO_TS.BUP", &ok);
+  put_in_place(outvtsdir, dirfd, "VIDEO_TS.IFO", &ok);
+  if (ok)
+    {
+      /* the renames are only safe once the directory itself is on disk */
+      io_delay(IO_FSYNC);
+      if (fsync(dirfd) != 0)
+        {
+          fprintf(stderr, "ERR:  cannot sync %s: %s\n", outvtsdir, strerror(errno));
+          ok = false;
+        } /*if*/
+    } /*if*/
+  close(dirfd);
+  free(outvtsdir);
+  return ok;
+} /*dvdauthor_vmgm_write*/
+
+bool dvdauthor_vmgm_gen(struct menugroup *menus, const struct toc_summary *ts, const char *outbase, unsigned int *outcrc)
+/* generates a VMG in outbase from the titlesets previously collected by
+   toc_summary_scan, as per dvdauthor_vmgm_layout and dvdauthor_vmgm_write. */
+{
+  struct vmg_image *img;
+  bool ok;
+
+  *outcrc = 0;
+  if (!ts) // can't really make a vmgm without titlesets
+    return false;
+  img = dvdauthor_vmgm_layout(menus, ts);
+  ok = dvdauthor_vmgm_write(img, outbase, outcrc);
+  vmg_image_free(img);
+  return ok;
+} /*dvdauthor_vmgm_gen*/
@@ -27,7 +27,24 @@
 extern "C" {
 #endif
 
-extern int default_video_format; /* defined in dvdcli.c */
+extern int default_video_format; /* defined in settings.c */
+extern bool repair_ifo; /* defined in settings.c */
+extern double job_deadline; /* defined in settings.c */
+
+enum scan_io /* how existing files are read when scanning */
+  {
+    SCAN_IO_CACHED, /* plainly, through the page cache */
+    SCAN_IO_DROP, /* without touching access times, leaving the page cache as it was */
+    SCAN_IO_DIRECT, /* as SCAN_IO_DROP, but bypassing the page cache where possible */
+  };
+extern enum scan_io scan_io; /* defined in settings.c */
+extern int hedge_percentile; /* defined in settings.c */
+
+struct hedge_stats { /* how --hedge has gone */
+    unsigned long reads; /* VTS IFO headers read */
+    unsigned long hedged; /* how many of those were read from the BUP as well */
+    unsigned long won; /* how many of those the BUP was used for */
+};
 
 typedef enum /* type of menu/title */
   { /* note assigned values cannot be changed */
@@ -46,14 +63,116 @@ struct pgcgroup;
 struct pgc;
 struct source;
 struct cell;
+struct toc_summary;
+struct vmg_image; /* defined in mi-internal.h */
+
+struct catalog; /* defined in catalog.c */
+struct journal; /* defined in journal.c */
 
+enum journal_status /* outcome of processing a directory, as recorded in the journal */
+  {
+    JOURNAL_DONE = 0, /* VMG generated */
+    JOURNAL_SKIP = 1, /* VMG already present */
+    JOURNAL_FAIL = 2, /* something went wrong, try again next time */
+    JOURNAL_TIMEOUT = 3, /* abandoned after exceeding the deadline, try again next time */
+  };
 
 
-void dvdauthor_vmgm_gen(struct menugroup *menus,const char *fbase);
+
+struct toc_summary *toc_summary_scan(const char *fbase);
+void toc_summary_free(struct toc_summary *ts);
+bool dvdauthor_vmgm_gen(struct menugroup *menus,const struct toc_summary *ts,const char *outbase,unsigned int *outcrc);
+struct vmg_image *dvdauthor_vmgm_layout(struct menugroup *menus, const struct toc_summary *ts);
+bool dvdauthor_vmgm_write(const struct vmg_image *img, const char *outbase, unsigned int *outcrc);
+void vmg_image_free(struct vmg_image *img);
+void *toc_summary_pack(const struct toc_summary *ts, size_t *len);
+struct toc_summary *toc_summary_unpack(const void *buf, size_t len);
+double monotime(void);
+int scan_openat(int dirfd, const char *name, int flags);
+void hedge_stats_get(struct hedge_stats *stats);
 void menugroup_add_pgcgroup(struct menugroup *mg,const char *lang,struct pgcgroup *pg);
 struct menugroup *menugroup_new();
+void menugroup_free(struct menugroup *mg);
 struct pgcgroup *pgcgroup_new(vtypes type);
 
+enum vmg_stamp /* what the stamp on a VMG says about it */
+  {
+    VMG_STAMP_NONE, /* not generated by mkinfo, or no VMG at all */
+    VMG_STAMP_STALE, /* generated by mkinfo and still as written, but not from the current titlesets */
+    VMG_STAMP_CURRENT, /* generated by this mkinfo from the current titlesets */
+  };
+
+enum vmg_stamp vmg_stamp_check(const char *srcbase, const char *outbase);
+void vmg_stamp_set(const char *srcbase, const char *outbase, unsigned int vmgcrc);
+
+struct catalog *catalog_create(const char *fname);
+void catalog_add(struct catalog *cat, const char *dirname, const struct toc_summary *ts);
+void catalog_finish(struct catalog *cat);
+int catalog_query(const char *fname, const char *query);
+
+int audit_directory(const char *dirname);
+
+struct journal *journal_open(const char *fname);
+bool journal_finished(struct journal *j, const char *dirname);
+void journal_record(struct journal *j, const char *dirname, enum journal_status status, unsigned int outcrc);
+void journal_close(struct journal *j);
+
+enum pool_outcome /* what became of a job given to a worker process */
+  {
+    POOL_DONE, /* finished, with a result */
+    POOL_CRASHED, /* worker died */
+    POOL_TIMEDOUT, /* worker killed for taking too long */
+  };
+
+void pool_run
+  (
+    int numworkers,
+    int recycle,
+    int timeout,
+    const char *(*next)(void *arg),
+    void *(*work)(const char *request, size_t *len, void *arg),
+    void (*done)(const char *request, const void *result, size_t len, enum pool_outcome outcome, void *arg),
+    void (*abandon)(const char *request, void *arg),
+    void *arg
+  );
+
+struct devsched; /* defined in devsched.c */
+
+struct devsched *devsched_new(int perdev, bool extent_order, const char *(*source)(void *arg), void *arg);
+const char *devsched_next(struct devsched *ds, bool wait);
+void devsched_done(struct devsched *ds, const char *dirname);
+void devsched_free(struct devsched *ds);
+
+enum io_op /* kinds of storage operation, for io_delay */
+  {
+    IO_OPEN,
+    IO_READDIR,
+    IO_READ,
+    IO_WRITE,
+    IO_FSYNC,
+    IO_NUMOPS /* not an operation */
+  };
+
+bool io_latency_parse(const char *spec);
+void io_delay(enum io_op op);
+
+struct pipeline_stage { /* one stage of a pipeline, see pipeline_run */
+    const char *name;
+    int numthreads;
+    void (*process)(void *job, void *arg); /* does this stage's work on job */
+};
+
+void pipeline_run
+  (
+    const struct pipeline_stage *stages,
+    int numstages,
+    int depth,
+    int metrics_interval,
+    void *(*source)(void *arg),
+    void (*sink)(void *job, void *arg),
+    void *arg
+  );
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,362 @@
+/*
+    mkinfo -- running jobs through a series of stages, each with its own
+    threads, connected by bounded queues
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+/*
+    Jobs are handed from one stage to the next through fixed-size ring buffers
+    (Vyukov's bounded MPMC queue), which need no locks. A pair of counting
+    semaphores per queue makes a thread block when there is nothing for it to
+    take, or no room to put what it has finished, so a slow stage holds back
+    the ones before it instead of letting jobs pile up in memory. A NULL job
+    marks the end of the input; each stage passes on one per thread of the
+    next stage once all its own threads have seen one.
+*/
+
+#include "config.h"
+#include "compat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+
+#include "mkinfo.h"
+
+struct queue_cell {
+    atomic_size_t seq; /* which lap of the ring the cell is ready for */
+    void *job;
+};
+
+struct queue { /* bounded multi-producer, multi-consumer queue of jobs */
+    struct queue_cell *cells;
+    size_t mask; /* number of cells - 1, a power of 2 minus 1 */
+    int capacity; /* jobs allowed in the queue at once, at most mask + 1 */
+    atomic_size_t enqpos, deqpos;
+    sem_t items, slots; /* jobs in queue, free places in queue */
+    atomic_int depth, maxdepth;
+};
+
+struct stagerun { /* a pipeline stage in action */
+    const struct pipeline_stage *stage;
+    struct queue *in, *out;
+    int nextthreads; /* number of end markers to pass on to the next stage */
+    void *arg;
+    pthread_t *threads;
+    atomic_int running; /* threads not yet finished */
+    atomic_int busy; /* threads currently working on a job */
+    atomic_ulong jobs; /* jobs done */
+    atomic_ullong busyns; /* total time spent on them */
+};
+
+struct feeder { /* the thread that puts jobs into the pipeline */
+    void *(*source)(void *arg);
+    void *arg;
+    struct queue *out;
+    int nextthreads;
+};
+
+static struct queue *queue_new(int capacity)
+{
+  struct queue * const q = calloc(1, sizeof(struct queue));
+  size_t i, size = 1;
+  while (size < (size_t)capacity)
+    size *= 2;
+  q->cells = calloc(size, sizeof(struct queue_cell));
+  if (!q->cells)
+    {
+      fprintf(stderr, "ERR:  pipeline: out of memory\n");
+      exit(1);
+    } /*if*/
+  for (i = 0; i < size; i++)
+    atomic_init(&q->cells[i].seq, i);
+  q->mask = size - 1;
+  q->capacity = capacity;
+  sem_init(&q->items, 0, 0);
+  sem_init(&q->slots, 0, capacity);
+  return q;
+} /*queue_new*/
+
+static void queue_free(struct queue *q)
+{
+  sem_destroy(&q->items);
+  sem_destroy(&q->slots);
+  free(q->cells);
+  free(q);
+} /*queue_free*/
+
+static void queue_push(struct queue *q, void *job)
+/* adds job to q, waiting for room if it is full. */
+{
+  struct queue_cell *cell;
+  size_t pos;
+  int depth, max;
+  while (sem_wait(&q->slots) != 0)
+    /* interrupted, try again */;
+  /* there is now a place for job, though its cell may still be being emptied */
+  pos = atomic_load_explicit(&q->enqpos, memory_order_relaxed);
+  for (;;)
+    {
+      intptr_t diff;
+      cell = &q->cells[pos & q->mask];
+      diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+      if (diff == 0)
+        {
+          if (atomic_compare_exchange_weak_explicit
+              (&q->enqpos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            break;
+        }
+      else
+        {
+          if (diff < 0)
+            sched_yield(); /* consumer hasn't finished with this cell yet */
+          pos = atomic_load_explicit(&q->enqpos, memory_order_relaxed);
+        } /*if*/
+    } /*for*/
+  cell->job = job;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  depth = atomic_fetch_add(&q->depth, 1) + 1;
+  max = atomic_load(&q->maxdepth);
+  while (depth > max && !atomic_compare_exchange_weak(&q->maxdepth, &max, depth))
+    /* somebody else changed it, try again */;
+  sem_post(&q->items);
+} /*queue_push*/
+
+static void *queue_take(struct queue *q)
+/* removes the oldest job from q, which must be known not to be empty. */
+{
+  struct queue_cell *cell;
+  size_t pos;
+  void *job;
+  pos = atomic_load_explicit(&q->deqpos, memory_order_relaxed);
+  for (;;)
+    {
+      intptr_t diff;
+      cell = &q->cells[pos & q->mask];
+      diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+      if (diff == 0)
+        {
+          if (atomic_compare_exchange_weak_explicit
+              (&q->deqpos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            break;
+        }
+      else
+        {
+          if (diff < 0)
+            sched_yield(); /* producer hasn't finished filling this cell yet */
+          pos = atomic_load_explicit(&q->deqpos, memory_order_relaxed);
+        } /*if*/
+    } /*for*/
+  job = cell->job;
+  atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+  atomic_fetch_sub(&q->depth, 1);
+  sem_post(&q->slots);
+  return job;
+} /*queue_take*/
+
+static void *queue_pop(struct queue *q)
+/* removes the oldest job from q, waiting for one if it is empty. */
+{
+  while (sem_wait(&q->items) != 0)
+    /* interrupted, try again */;
+  return queue_take(q);
+} /*queue_pop*/
+
+static bool queue_pop_until(struct queue *q, const struct timespec *until, void **job)
+/* as queue_pop, but gives up and returns false if there is still nothing to
+   take at time until (by CLOCK_REALTIME). */
+{
+  for (;;)
+    {
+      if (sem_timedwait(&q->items, until) == 0)
+        break;
+      if (errno == ETIMEDOUT)
+        return false;
+    } /*for*/
+  *job = queue_take(q);
+  return true;
+} /*queue_pop_until*/
+
+static uint64_t nanotime(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+} /*nanotime*/
+
+static void *feeder_thread(void *p)
+{
+  struct feeder * const f = p;
+  void *job;
+  int i;
+  while ((job = f->source(f->arg)) != 0)
+    queue_push(f->out, job);
+  for (i = 0; i < f->nextthreads; i++)
+    queue_push(f->out, 0);
+  return 0;
+} /*feeder_thread*/
+
+static void *stage_thread(void *p)
+{
+  struct stagerun * const sr = p;
+  for (;;)
+    {
+      uint64_t start;
+      void * const job = queue_pop(sr->in);
+      if (!job)
+        break;
+      atomic_fetch_add(&sr->busy, 1);
+      start = nanotime();
+      sr->stage->process(job, sr->arg);
+      atomic_fetch_add(&sr->busyns, nanotime() - start);
+      atomic_fetch_add(&sr->jobs, 1);
+      atomic_fetch_sub(&sr->busy, 1);
+      queue_push(sr->out, job);
+    } /*for*/
+  if (atomic_fetch_sub(&sr->running, 1) == 1)
+    {
+      /* last one out tells the next stage */
+      int i;
+      for (i = 0; i < sr->nextthreads; i++)
+        queue_push(sr->out, 0);
+    } /*if*/
+  return 0;
+} /*stage_thread*/
+
+static void report(const struct stagerun *runs, int numstages, const struct queue *done)
+/* prints the current queue depths and numbers of busy threads. */
+{
+  char line[1024];
+  size_t len = 0;
+  int i;
+  line[0] = 0;
+  for (i = 0; i < numstages; i++)
+    len += snprintf
+      (
+        line + len, sizeof line - len, "%s %d/%d [%d/%d busy], ",
+        runs[i].stage->name,
+        atomic_load(&runs[i].in->depth), runs[i].in->capacity,
+        atomic_load(&runs[i].busy), runs[i].stage->numthreads
+      );
+  fprintf(stderr, "INFO: pipeline: %sdone %d/%d\n", line, atomic_load(&done->depth), done->capacity);
+} /*report*/
+
+void pipeline_run
+  (
+    const struct pipeline_stage *stages,
+    int numstages,
+    int depth,
+    int metrics_interval,
+    void *(*source)(void *arg),
+    void (*sink)(void *job, void *arg),
+    void *arg
+  )
+/* runs every job returned by source (on a thread of its own, until it returns
+   NULL) through each of the stages in turn, then hands it to sink on the calling
+   thread. Each stage has its own threads, and takes its jobs from a queue of at
+   most depth jobs. If metrics_interval is nonzero, the queue depths are reported
+   every that many seconds; they and the time spent in each stage are always
+   reported at the end. */
+{
+  struct stagerun * const runs = calloc(numstages, sizeof(struct stagerun));
+  struct queue *done;
+  struct feeder feeder;
+  pthread_t feedthread;
+  struct timespec nextreport;
+  const uint64_t start = nanotime();
+  double elapsed;
+  int i, j;
+
+  for (i = 0; i < numstages; i++)
+    {
+      runs[i].stage = &stages[i];
+      runs[i].in = i ? runs[i - 1].out : queue_new(depth);
+      runs[i].out = queue_new(depth);
+      runs[i].nextthreads = i + 1 < numstages ? stages[i + 1].numthreads : 1;
+      runs[i].arg = arg;
+      atomic_init(&runs[i].running, stages[i].numthreads);
+    } /*for*/
+  done = runs[numstages - 1].out;
+  for (i = 0; i < numstages; i++)
+    {
+      runs[i].threads = calloc(stages[i].numthreads, sizeof(pthread_t));
+      for (j = 0; j < stages[i].numthreads; j++)
+        if (pthread_create(&runs[i].threads[j], 0, stage_thread, &runs[i]) != 0)
+          {
+            fprintf(stderr, "ERR:  cannot start %s thread\n", stages[i].name);
+            exit(1);
+          } /*if*/
+    } /*for*/
+  feeder.source = source;
+  feeder.arg = arg;
+  feeder.out = runs[0].in;
+  feeder.nextthreads = stages[0].numthreads;
+  if (pthread_create(&feedthread, 0, feeder_thread, &feeder) != 0)
+    {
+      fprintf(stderr, "ERR:  cannot start feeder thread\n");
+      exit(1);
+    } /*if*/
+
+  clock_gettime(CLOCK_REALTIME, &nextreport);
+  nextreport.tv_sec += metrics_interval;
+  for (;;)
+    {
+      void *job;
+      if (metrics_interval)
+        {
+          if (!queue_pop_until(done, &nextreport, &job))
+            {
+              report(runs, numstages, done);
+              nextreport.tv_sec += metrics_interval;
+              continue;
+            } /*if*/
+        }
+      else
+        job = queue_pop(done);
+      if (!job)
+        break;
+      sink(job, arg);
+    } /*for*/
+
+  pthread_join(feedthread, 0);
+  elapsed = (nanotime() - start) / 1e9;
+  for (i = 0; i < numstages; i++)
+    {
+      for (j = 0; j < stages[i].numthreads; j++)
+        pthread_join(runs[i].threads[j], 0);
+      fprintf
+        (
+          stderr,
+          "INFO: pipeline stage %s: %d threads, %lu jobs, %.1f%% busy, queue max %d/%d\n",
+          stages[i].name, stages[i].numthreads, (unsigned long)atomic_load(&runs[i].jobs),
+          elapsed > 0 ? atomic_load(&runs[i].busyns) / 1e7 / elapsed / stages[i].numthreads : 0.0,
+          atomic_load(&runs[i].in->maxdepth), depth
+        );
+      queue_free(runs[i].in);
+      free(runs[i].threads);
+    } /*for*/
+  queue_free(done);
+  free(runs);
+} /*pipeline_run*/
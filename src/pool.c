@@ -0,0 +1,425 @@
+/*
+    mkinfo -- a pool of worker processes, so that a job that crashes or hangs
+    takes only its own worker down with it
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+/*
+    The workers are forked once, up front, and then fed one request at a time
+    over a pipe each; each sends back a result over another pipe. A request is
+    a struct poolreq followed by the request string, a result is a uint32_t
+    length followed by that many bytes.
+
+    A worker that exits or dies in the middle of a job is noticed by its result
+    pipe reaching EOF early; one that overruns the deadline is killed and
+    abandoned. Either way the job is reported as failed and a fresh worker
+    takes its place. Workers also exit of their own accord after a given number
+    of jobs, to put a limit on whatever they might leak.
+
+    Whatever a killed worker left half done is cleaned up by another process
+    forked for the purpose, so that if the cleanup gets stuck on the same
+    storage the worker did, the rest of the run isn't held up. It waits for the
+    worker to be gone first, so nothing the worker was still in the middle of
+    can reappear after it.
+*/
+
+#include "config.h"
+#include "compat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "mkinfo.h"
+
+struct poolreq { /* header of a request sent to a worker */
+    uint32_t len; /* length of request string that follows */
+    double deadline; /* for job_deadline, 0 for none */
+};
+
+struct worker { /* what the supervisor knows about a worker */
+    pid_t pid;
+    int reqfd, resfd; /* ends of pipes to and from the worker */
+    char *request; /* job in progress, NULL if idle */
+    double deadline; /* by when it must be finished */
+    unsigned char *buf; /* result so far */
+    size_t len, maxlen;
+    int jobs; /* number done */
+};
+
+struct pool {
+    struct worker *workers;
+    int numworkers;
+    int recycle; /* jobs per worker, 0 for no limit */
+    pid_t *abandoned; /* killed workers, and cleaners, not yet reaped */
+    int numabandoned;
+    pid_t *cleaners; /* cleaners not yet finished */
+    int numcleaners;
+    void *(*work)(const char *request, size_t *len, void *arg);
+    void (*abandon)(const char *request, void *arg);
+    void *arg;
+};
+
+static bool readfull(int fd, void *buf, size_t len)
+/* reads exactly len bytes, returning false on EOF or error. */
+{
+  while (len)
+    {
+      const ssize_t n = read(fd, buf, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      buf = (char *)buf + n;
+      len -= n;
+    } /*while*/
+  return true;
+} /*readfull*/
+
+static bool writefull(int fd, const void *buf, size_t len)
+{
+  while (len)
+    {
+      const ssize_t n = write(fd, buf, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      buf = (const char *)buf + n;
+      len -= n;
+    } /*while*/
+  return true;
+} /*writefull*/
+
+static void worker_main(struct pool *pool, int reqfd, int resfd)
+/* the life of a worker: does jobs until told to stop, or recycling is due. */
+{
+  struct poolreq req;
+  int jobs = 0;
+  while (readfull(reqfd, &req, sizeof req))
+    {
+      char * const request = malloc(req.len + 1);
+      void *result;
+      size_t len = 0;
+      uint32_t len32;
+      if (!readfull(reqfd, request, req.len))
+        break;
+      request[req.len] = 0;
+      job_deadline = req.deadline;
+      result = pool->work(request, &len, pool->arg);
+      len32 = len;
+      fflush(0);
+      if (!writefull(resfd, &len32, sizeof len32) || !writefull(resfd, result, len))
+        break;
+      free(result);
+      free(request);
+      if (pool->recycle && ++jobs == pool->recycle)
+        break;
+    } /*while*/
+  fflush(0);
+  _exit(0);
+} /*worker_main*/
+
+static void start_worker(struct pool *pool, struct worker *w)
+{
+  int reqpipe[2], respipe[2], i;
+  fflush(0); /* so the worker doesn't write out anything buffered a second time */
+  if (pipe(reqpipe) != 0 || pipe(respipe) != 0 || (w->pid = fork()) < 0)
+    {
+      fprintf(stderr, "ERR:  cannot start worker: %s\n", strerror(errno));
+      exit(1);
+    } /*if*/
+  if (w->pid == 0)
+    {
+      /* don't hold the other workers' pipes open, or their ends would never be noticed */
+      for (i = 0; i < pool->numworkers; i++)
+        if (&pool->workers[i] != w && pool->workers[i].pid > 0)
+          {
+            close(pool->workers[i].reqfd);
+            close(pool->workers[i].resfd);
+          } /*if*/
+      close(reqpipe[1]);
+      close(respipe[0]);
+      worker_main(pool, reqpipe[0], respipe[1]);
+    } /*if*/
+  close(reqpipe[0]);
+  close(respipe[1]);
+  w->reqfd = reqpipe[1];
+  w->resfd = respipe[0];
+  w->request = 0;
+  w->len = 0;
+  w->jobs = 0;
+} /*start_worker*/
+
+static bool gone(pid_t pid)
+/* has process pid exited (whether or not it has been reaped). */
+{
+  char fname[32], state = 0;
+  FILE *h;
+  snprintf(fname, sizeof fname, "/proc/%ld/stat", (long)pid);
+  h = fopen(fname, "r");
+  if (!h)
+    return true; /* reaped already, or no /proc to tell */
+  if (fscanf(h, "%*d (%*[^)]) %c", &state) != 1)
+    state = 'Z';
+  fclose(h);
+  return state == 'Z' || state == 'X';
+} /*gone*/
+
+static void start_cleaner(struct pool *pool, pid_t worker, const char *request)
+/* cleans up after request, abandoned by a killed worker, in a process of its own. */
+{
+  const struct timespec interval = {0, 50000000};
+  pid_t pid;
+  fflush(0);
+  pid = fork();
+  if (pid < 0)
+    {
+      fprintf(stderr, "WARN: cannot clean up after %s: %s\n", request, strerror(errno));
+      return;
+    } /*if*/
+  if (pid == 0)
+    {
+      while (!gone(worker))
+        nanosleep(&interval, 0);
+      pool->abandon(request, pool->arg);
+      fflush(0);
+      _exit(0);
+    } /*if*/
+  pool->cleaners = realloc(pool->cleaners, (pool->numcleaners + 1) * sizeof(pid_t));
+  pool->cleaners[pool->numcleaners++] = pid;
+} /*start_cleaner*/
+
+static void stop_worker(struct pool *pool, struct worker *w, bool kill_it)
+/* gets rid of a worker that has finished or is to be abandoned. */
+{
+  close(w->reqfd);
+  close(w->resfd);
+  if (kill_it)
+    {
+      kill(w->pid, SIGKILL);
+      if (pool->abandon)
+        start_cleaner(pool, w->pid, w->request);
+      /* don't wait for it, it may be stuck in I/O */
+      pool->abandoned = realloc(pool->abandoned, (pool->numabandoned + 1) * sizeof(pid_t));
+      pool->abandoned[pool->numabandoned++] = w->pid;
+    }
+  else
+    waitpid(w->pid, 0, 0);
+  w->pid = 0;
+  free(w->request);
+  w->request = 0;
+} /*stop_worker*/
+
+static void reap_abandoned(struct pool *pool)
+{
+  int i;
+  for (i = 0; i < pool->numabandoned;)
+    if (waitpid(pool->abandoned[i], 0, WNOHANG) != 0)
+      pool->abandoned[i] = pool->abandoned[--pool->numabandoned];
+    else
+      i++;
+  for (i = 0; i < pool->numcleaners;)
+    if (waitpid(pool->cleaners[i], 0, WNOHANG) != 0)
+      pool->cleaners[i] = pool->cleaners[--pool->numcleaners];
+    else
+      i++;
+} /*reap_abandoned*/
+
+void pool_run
+  (
+    int numworkers,
+    int recycle,
+    int timeout,
+    const char *(*next)(void *arg),
+    void *(*work)(const char *request, size_t *len, void *arg),
+    void (*done)(const char *request, const void *result, size_t len, enum pool_outcome outcome, void *arg),
+    void (*abandon)(const char *request, void *arg),
+    void *arg
+  )
+/* hands each request returned by next to work in one of numworkers worker
+   processes, and the malloc'ed result it returns to done in this process. next
+   may return NULL while jobs are in progress if it has nothing to hand out until
+   one of them is done; the run ends when it returns NULL with none in progress.
+   A worker is replaced after recycle jobs if nonzero, and killed
+   if a job takes longer than timeout seconds if nonzero, in which case abandon,
+   if not NULL, is called in a separate process once it is gone to clean up after
+   the job. At the end, cleanups still going are given up to timeout seconds more
+   to finish. */
+{
+  struct pool pool;
+  struct pollfd *pfds = calloc(numworkers, sizeof(struct pollfd));
+  int i, busy = 0;
+
+  memset(&pool, 0, sizeof pool);
+  pool.workers = calloc(numworkers, sizeof(struct worker));
+  pool.numworkers = numworkers;
+  pool.recycle = recycle;
+  pool.work = work;
+  pool.abandon = abandon;
+  pool.arg = arg;
+  signal(SIGPIPE, SIG_IGN); /* a dead worker shows up as EOF, not this */
+  for (i = 0; i < numworkers; i++)
+    start_worker(&pool, &pool.workers[i]);
+
+  for (;;)
+    {
+      double now, wait = -1;
+      /* give idle workers something to do */
+      for (i = 0; i < numworkers; i++)
+        {
+          struct worker * const w = &pool.workers[i];
+          struct poolreq req;
+          const char *request;
+          if (w->request)
+            continue;
+          request = next(arg);
+          if (!request)
+            break;
+          w->request = strdup(request);
+          w->deadline = timeout ? monotime() + timeout : 0;
+          req.len = strlen(request);
+          req.deadline = w->deadline;
+          busy++;
+          if (!writefull(w->reqfd, &req, sizeof req) || !writefull(w->reqfd, request, req.len))
+            {
+              /* must have died while idle; its result pipe will be at EOF */
+            } /*if*/
+        } /*for*/
+      if (!busy)
+        break; /* nothing more to do */
+
+      now = monotime();
+      for (i = 0; i < numworkers; i++)
+        {
+          struct worker * const w = &pool.workers[i];
+          pfds[i].fd = w->resfd;
+          pfds[i].events = POLLIN;
+          pfds[i].revents = 0;
+          if (w->request && w->deadline && (wait < 0 || w->deadline - now < wait))
+            wait = w->deadline > now ? w->deadline - now : 0;
+        } /*for*/
+      if (poll(pfds, numworkers, wait < 0 ? -1 : (int)(wait * 1000) + 1) < 0 && errno != EINTR)
+        {
+          fprintf(stderr, "ERR:  poll: %s\n", strerror(errno));
+          exit(1);
+        } /*if*/
+
+      now = monotime();
+      for (i = 0; i < numworkers; i++)
+        {
+          struct worker * const w = &pool.workers[i];
+          uint32_t len32;
+          ssize_t n;
+          if (pfds[i].revents)
+            {
+              if (w->len == w->maxlen)
+                {
+                  w->maxlen = w->maxlen ? w->maxlen * 2 : 65536;
+                  w->buf = realloc(w->buf, w->maxlen);
+                } /*if*/
+              n = read(w->resfd, w->buf + w->len, w->maxlen - w->len);
+              if (n < 0 && errno == EINTR)
+                continue;
+              if (n <= 0)
+                {
+                  /* worker has gone */
+                  if (w->request)
+                    {
+                      int status = 0;
+                      close(w->reqfd);
+                      close(w->resfd);
+                      waitpid(w->pid, &status, 0);
+                      if (WIFSIGNALED(status))
+                        fprintf(stderr, "ERR:  %s: worker killed by signal %d\n", w->request, WTERMSIG(status));
+                      else
+                        fprintf(stderr, "ERR:  %s: worker exited with status %d\n", w->request, WEXITSTATUS(status));
+                      done(w->request, 0, 0, POOL_CRASHED, arg);
+                      busy--;
+                      free(w->request);
+                      w->pid = 0;
+                      w->request = 0;
+                    }
+                  else
+                    stop_worker(&pool, w, false); /* died while idle */
+                  start_worker(&pool, w);
+                  continue;
+                } /*if*/
+              w->len += n;
+              if (w->len >= sizeof len32)
+                {
+                  memcpy(&len32, w->buf, sizeof len32);
+                  if (w->len >= sizeof len32 + len32)
+                    {
+                      done(w->request, w->buf + sizeof len32, len32, POOL_DONE, arg);
+                      busy--;
+                      free(w->request);
+                      w->request = 0;
+                      w->len = 0;
+                      if (pool.recycle && ++w->jobs == pool.recycle)
+                        {
+                          /* it will exit now rather than take another job */
+                          stop_worker(&pool, w, false);
+                          start_worker(&pool, w);
+                        } /*if*/
+                    } /*if*/
+                } /*if*/
+            } /*if*/
+          if (w->request && w->deadline && now >= w->deadline)
+            {
+              fprintf(stderr, "ERR:  %s: timed out after %d seconds, abandoned\n", w->request, timeout);
+              done(w->request, 0, 0, POOL_TIMEDOUT, arg);
+              busy--;
+              stop_worker(&pool, w, true);
+              start_worker(&pool, w);
+            } /*if*/
+        } /*for*/
+      reap_abandoned(&pool);
+    } /*for*/
+
+  for (i = 0; i < numworkers; i++)
+    {
+      stop_worker(&pool, &pool.workers[i], false); /* EOF on its request pipe tells it to stop */
+      free(pool.workers[i].buf);
+    } /*for*/
+  reap_abandoned(&pool);
+  if (pool.numcleaners)
+    {
+      const double until = monotime() + timeout;
+      const struct timespec interval = {0, 10000000};
+      while (pool.numcleaners && monotime() < until)
+        {
+          nanosleep(&interval, 0);
+          reap_abandoned(&pool);
+        } /*while*/
+      if (pool.numcleaners)
+        fprintf(stderr, "WARN: %d cleanups after abandoned workers still not finished\n", pool.numcleaners);
+    } /*if*/
+  free(pool.cleaners);
+  free(pool.abandoned);
+  free(pool.workers);
+  free(pfds);
+} /*pool_run*/
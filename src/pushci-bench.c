@@ -0,0 +1,237 @@
+/*
+    mkinfo -- benchmark and check of pgcgroup_pushci, run by "make check"
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+/*
+    Builds pgcgroups of hundreds to thousands of PGCs, some sharing vobs and
+    some with colour tables of their own, and shares the colour tables out
+    both with pgcgroup_pushci and with the straightforward comparison of
+    every source against every other source that it replaced, the same way
+    pgcgroup_createvobs does. Fails if the two differ in the colour table
+    each PGC ends up with, the reference counts, or the warnings printed, and
+    reports how long each took.
+*/
+
+#include "config.h"
+#include "compat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "mkinfo.h"
+#include "mi-internal.h"
+
+struct vob { /* only ever referred to by address */
+    int id;
+};
+
+struct group { /* a pgcgroup and everything it points to */
+    struct pgcgroup pg;
+    struct pgc *pgcs;
+    struct source *sources;
+    struct source **sourceptrs;
+    struct colorinfo *colors;
+    int numcolors;
+};
+
+static uint64_t rnd_state;
+
+static unsigned int rnd(unsigned int n)
+/* returns a pseudorandom number in [0, n). */
+{
+  rnd_state = rnd_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (rnd_state >> 33) % n;
+} /*rnd*/
+
+static void group_make(struct group *g, int numpgcs, struct vob *vobs, uint64_t seed)
+/* fills in g with numpgcs PGCs of 1 to 3 sources each, using vobs from vobs
+   (which must have room for 3 * numpgcs). Most sources get a vob of their own,
+   the rest share one with an earlier source; about a third of the PGCs start
+   out with a colour table. The same seed always gives the same group. */
+{
+  int i, j, numsources = 0, numvobs = 0;
+  rnd_state = seed;
+  memset(g, 0, sizeof *g);
+  g->pgcs = calloc(numpgcs, sizeof(struct pgc));
+  g->pg.pgcs = calloc(numpgcs, sizeof(struct pgc *));
+  g->sources = calloc(3 * numpgcs, sizeof(struct source));
+  g->sourceptrs = calloc(3 * numpgcs, sizeof(struct source *));
+  g->colors = calloc(numpgcs, sizeof(struct colorinfo));
+  g->pg.numpgcs = numpgcs;
+  for (i = 0; i < numpgcs; i++)
+    {
+      struct pgc * const p = g->pgcs + i;
+      g->pg.pgcs[i] = p;
+      p->pgcgroup = &g->pg;
+      p->numsources = 1 + rnd(3);
+      p->sources = g->sourceptrs + numsources;
+      for (j = 0; j < p->numsources; j++)
+        {
+          struct source * const s = g->sources + numsources;
+          if (numvobs == 0 || rnd(4) != 0)
+            s->vob = vobs + numvobs++;
+          else
+            s->vob = g->sources[rnd(numsources)].vob;
+          g->sourceptrs[numsources++] = s;
+        } /*for*/
+      if (rnd(3) == 0)
+        {
+          p->colors = g->colors + g->numcolors++;
+          p->colors->refcount = 1;
+        } /*if*/
+    } /*for*/
+} /*group_make*/
+
+static void group_free(struct group *g)
+{
+  free(g->pgcs);
+  free(g->pg.pgcs);
+  free(g->sources);
+  free(g->sourceptrs);
+  free(g->colors);
+} /*group_free*/
+
+static void pushci_reference(struct pgcgroup *p, bool warn)
+/* what pgcgroup_pushci used to be. */
+{
+  int i, j, ii, jj;
+  for (i = 0; i < p->numpgcs; i++)
+    {
+      if (!p->pgcs[i]->colors)
+        continue;
+      for (j = 0; j < p->pgcs[i]->numsources; j++)
+        {
+          const struct vob * const v = p->pgcs[i]->sources[j]->vob;
+          for (ii = 0; ii < p->numpgcs; ii++)
+            for (jj = 0; jj < p->pgcs[ii]->numsources; jj++)
+              if (v == p->pgcs[ii]->sources[jj]->vob)
+                {
+                  if (!p->pgcs[ii]->colors)
+                    {
+                      p->pgcs[ii]->colors = p->pgcs[i]->colors;
+                      p->pgcs[ii]->colors->refcount++;
+                    }
+                  else if (p->pgcs[ii]->colors != p->pgcs[i]->colors && warn)
+                    {
+                      fprintf
+                        (
+                         stderr,
+                         "WARN: Conflict in colormap between PGC %d and %d\n",
+                         i, ii
+                         );
+                    } /*if*/
+                } /*if; for; for*/
+        } /*for*/
+    } /*for*/
+} /*pushci_reference*/
+
+static char *run_pushci(void (*pushci)(struct pgcgroup *p, bool warn), struct group *g, double *elapsed, size_t *len)
+/* runs pushci on g as pgcgroup_createvobs would, returning whatever it wrote
+   to stderr and setting *elapsed to how long it took. */
+{
+  FILE * const out = tmpfile();
+  const int saved = dup(2);
+  char *text;
+  double start;
+  fflush(stderr);
+  dup2(fileno(out), 2);
+  start = monotime();
+  pushci(&g->pg, false);
+  pushci(&g->pg, true);
+  *elapsed = monotime() - start;
+  fflush(stderr);
+  dup2(saved, 2);
+  close(saved);
+  *len = ftell(out);
+  text = malloc(*len + 1);
+  rewind(out);
+  *len = fread(text, 1, *len, out);
+  text[*len] = 0;
+  fclose(out);
+  return text;
+} /*run_pushci*/
+
+static bool same_result(const struct group *a, const struct group *b)
+/* do the PGCs in a and b end up with corresponding colour tables? */
+{
+  int i;
+  for (i = 0; i < a->pg.numpgcs; i++)
+    {
+      const struct colorinfo * const ca = a->pgcs[i].colors, * const cb = b->pgcs[i].colors;
+      if (!ca != !cb || (ca && ca - a->colors != cb - b->colors))
+        return false;
+    } /*for*/
+  for (i = 0; i < a->numcolors; i++)
+    if (a->colors[i].refcount != b->colors[i].refcount)
+      return false;
+  return true;
+} /*same_result*/
+
+int main(void)
+{
+  static const int sizes[] = {100, 300, 1000, 3000};
+  const int rounds = 3;
+  bool ok = true;
+  size_t s;
+  int r;
+  for (s = 0; s < sizeof sizes / sizeof sizes[0]; s++)
+    {
+      const int n = sizes[s];
+      struct vob * const vobs = calloc(3 * n, sizeof(struct vob));
+      double reftime = 0, newtime = 0, t;
+      size_t numwarnings = 0, reflen, newlen, k;
+      for (r = 0; r < rounds; r++)
+        {
+          struct group ref, new;
+          char *reftext, *newtext;
+          group_make(&ref, n, vobs, r + 1);
+          group_make(&new, n, vobs, r + 1);
+          reftext = run_pushci(pushci_reference, &ref, &t, &reflen);
+          reftime += t;
+          newtext = run_pushci(pgcgroup_pushci, &new, &t, &newlen);
+          newtime += t;
+          if (!same_result(&ref, &new))
+            {
+              fprintf(stderr, "ERR:  %d PGCs, round %d: colour tables differ\n", n, r);
+              ok = false;
+            } /*if*/
+          if (reflen != newlen || memcmp(reftext, newtext, reflen))
+            {
+              fprintf(stderr, "ERR:  %d PGCs, round %d: warnings differ\n", n, r);
+              ok = false;
+            } /*if*/
+          for (k = 0; k < reflen; k++)
+            numwarnings += reftext[k] == '\n';
+          free(reftext);
+          free(newtext);
+          group_free(&ref);
+          group_free(&new);
+        } /*for*/
+      printf
+        (
+          "%5d PGCs: %8.5fs before, %8.5fs now, %lu conflict warnings\n",
+          n, reftime / rounds, newtime / rounds, (unsigned long)numwarnings / rounds
+        );
+      free(vobs);
+    } /*for*/
+  return ok ? 0 : 1;
+} /*main*/
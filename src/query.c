@@ -0,0 +1,350 @@
+/*
+    mkinfo -- searching a catalog by stream attributes
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+#include "config.h"
+#include "compat.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mkinfo.h"
+#include "mi-internal.h"
+#include "catalog.h"
+
+/*
+    Decoding of the attribute bytes as stored in the VTS IFO, into the
+    same values the keyword tables in mkinfo.c describe.
+*/
+
+static const unsigned char aformat_codes[8] = {1, 0, 2, 2, 3, 0, 4, 0};
+  /* audio coding mode -> aformat: ac3, -, mpeg1, mpeg2ext, lpcm, -, dts, - */
+
+void vtsattr_decode_video(const unsigned char *v, struct videodesc *vd)
+/* decodes a 2-byte video attribute. */
+{
+  memset(vd, 0, sizeof(struct videodesc));
+  vd->vmpeg = (v[0] >> 6 & 3) + 1;
+  vd->vformat = (v[0] >> 4 & 3) + 1;
+  vd->vaspect = (v[0] >> 2 & 3) == 3 ? 2 : 1;
+  if (vd->vaspect == 2)
+    vd->vwidescreen = v[0] & 3; /* 1 => pan-scan only, 2 => letterbox only */
+  if (vd->vwidescreen == 3)
+    vd->vwidescreen = 0;
+  vd->vcaption = v[1] >> 6 & 3;
+  vd->vres = (v[1] >> 3 & 7) + 1;
+  if (vd->vres > 4)
+    vd->vres = 0;
+} /*vtsattr_decode_video*/
+
+void vtsattr_decode_audio(const unsigned char *a, struct audiodesc *ad)
+/* decodes an 8-byte audio stream attribute. */
+{
+  memset(ad, 0, sizeof(struct audiodesc));
+  ad->aformat = aformat_codes[a[0] >> 5];
+  ad->alangpresent = (a[0] >> 2 & 3) == 1 ? 2 : 1;
+  ad->adolby = (a[0] & 3) == 2 ? 1 : 0;
+  ad->aquant = (a[1] >> 6) + 1;
+  ad->asample = (a[1] >> 4 & 3) + 1;
+  if (ad->asample > 2)
+    ad->asample = 0;
+  ad->achannels = (a[1] & 7) + 1;
+  ad->lang[0] = tolower(a[2]);
+  ad->lang[1] = tolower(a[3]);
+  ad->acontent = a[5] <= 4 ? a[5] : 0;
+} /*vtsattr_decode_audio*/
+
+void vtsattr_decode_subpic(const unsigned char *s, struct subpicdesc *sd)
+/* decodes a 6-byte subpicture stream attribute. */
+{
+  memset(sd, 0, sizeof(struct subpicdesc));
+  sd->slangpresent = (s[0] & 3) == 1 ? 2 : 1;
+  sd->lang[0] = tolower(s[2]);
+  sd->lang[1] = tolower(s[3]);
+  sd->scontent = s[5];
+} /*vtsattr_decode_subpic*/
+
+/*
+    Batched decoding. Titlesets are decoded BATCH at a time into a
+    struct-of-arrays, so that each query term is a simple loop over
+    contiguous bytes which the compiler can vectorise.
+*/
+
+#define BATCH 512
+
+struct attrbatch {
+    int n; /* number of titlesets in batch */
+    uint8_t numaudio[BATCH], numsubp[BATCH];
+    uint8_t vmpeg[BATCH], vres[BATCH], vformat[BATCH], vaspect[BATCH], vwidescreen[BATCH];
+    uint8_t aformat[8][BATCH], aquant[8][BATCH], adolby[8][BATCH], achannels[8][BATCH];
+    uint8_t alangpresent[8][BATCH], asample[8][BATCH], acontent[8][BATCH];
+    uint16_t alang[8][BATCH];
+    uint16_t slang[32][BATCH]; /* 0 if stream absent or has no language */
+      /* language codes are folded to lower case by setting bit 5 of each letter */
+};
+
+static void decode_batch(struct attrbatch *b, const struct mkcat_titleset *ts, int n)
+{
+  int i, s;
+  b->n = n;
+  for (i = 0; i < n; i++)
+    {
+      const unsigned char * const v = ts[i].title_video;
+      b->numaudio[i] = ts[i].numaudio;
+      b->numsubp[i] = ts[i].numsubp;
+      b->vmpeg[i] = (v[0] >> 6 & 3) + 1;
+      b->vformat[i] = (v[0] >> 4 & 3) + 1;
+      b->vaspect[i] = (v[0] >> 2 & 3) == 3 ? 2 : 1;
+      b->vwidescreen[i] = b->vaspect[i] == 2 && (v[0] & 3) != 3 ? v[0] & 3 : 0;
+      b->vres[i] = (v[1] >> 3 & 7) + 1;
+    } /*for*/
+  for (s = 0; s < 8; s++)
+    for (i = 0; i < n; i++)
+      {
+        const unsigned char * const a = ts[i].audio[s];
+        /* streams beyond numaudio were zeroed by catalog_add; mask them out
+           so that zero codes don't match anything */
+        const uint8_t present = s < b->numaudio[i] ? 0xff : 0;
+        b->aformat[s][i] = aformat_codes[a[0] >> 5] & present;
+        b->alangpresent[s][i] = ((a[0] >> 2 & 3) == 1 ? 2 : 1) & present;
+        b->adolby[s][i] = ((a[0] & 3) == 2) & present;
+        b->aquant[s][i] = ((a[1] >> 6) + 1) & present;
+        b->asample[s][i] = ((a[1] >> 4 & 3) + 1) & present;
+        b->achannels[s][i] = ((a[1] & 7) + 1) & present;
+        b->acontent[s][i] = a[5] & present;
+        b->alang[s][i] = (a[2] << 8 | a[3] | 0x2020) & (present ? 0xffff : 0);
+      } /*for; for*/
+  for (s = 0; s < 32; s++)
+    for (i = 0; i < n; i++)
+      {
+        const unsigned char * const sp = ts[i].subp[s];
+        b->slang[s][i] =
+            s < b->numsubp[i] && (sp[0] & 3) == 1 ? sp[2] << 8 | sp[3] | 0x2020 : 0;
+      } /*for; for*/
+} /*decode_batch*/
+
+enum termkind
+  {
+    T_VMPEG, T_VRES, T_VFORMAT, T_VASPECT, T_VWIDESCREEN, /* title video attribute equals value */
+    T_AFORMAT, T_AQUANT, T_ADOLBY, T_ACHANNELS, T_ALANGPRESENT, T_ASAMPLE, T_ACONTENT,
+      /* some audio stream has attribute value */
+    T_ALANG, /* some audio stream has language */
+    T_SLANG, /* some subpicture stream has language */
+  };
+
+struct term {
+    enum termkind kind;
+    bool negate;
+    int value;
+};
+
+static const struct {
+    const char * const *desc;
+    enum termkind kind;
+} keywords[] =
+  {
+    {vmpegdesc, T_VMPEG},
+    {vresdesc, T_VRES},
+    {vformatdesc, T_VFORMAT},
+    {vaspectdesc, T_VASPECT},
+    {vwidescreendesc, T_VWIDESCREEN},
+    {aformatdesc, T_AFORMAT},
+    {aquantdesc, T_AQUANT},
+    {adolbydesc, T_ADOLBY},
+    {achanneldesc, T_ACHANNELS},
+    {alangdesc, T_ALANGPRESENT},
+    {asampledesc, T_ASAMPLE},
+    {acontentdesc, T_ACONTENT},
+  };
+
+static bool parse_term(const char *word, struct term *t)
+/* parses one comma-separated word of a query. */
+{
+  size_t i;
+  int j;
+  t->negate = word[0] == '!';
+  if (t->negate)
+    word++;
+  if
+    (
+        (!strncmp(word, "alang=", 6) || !strncmp(word, "slang=", 6))
+    &&
+        strlen(word) == 8
+    )
+    {
+      t->kind = word[0] == 'a' ? T_ALANG : T_SLANG;
+      t->value = word[6] << 8 | word[7] | 0x2020;
+      return true;
+    } /*if*/
+  /* the attribute keywords are all unique, so the keyword alone identifies the attribute */
+  for (i = 0; i < sizeof keywords / sizeof keywords[0]; i++)
+    for (j = 1; keywords[i].desc[j]; j++)
+      if (!strcasecmp(word, keywords[i].desc[j]))
+        {
+          t->kind = keywords[i].kind;
+          t->value = j;
+          return true;
+        } /*if; for; for*/
+  return false;
+} /*parse_term*/
+
+static void match_video(uint8_t *m, const uint8_t *attr, int n, int value)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    m[i] = attr[i] == value;
+} /*match_video*/
+
+static void match_audio(uint8_t *m, uint8_t attr[8][BATCH], int n, int value)
+{
+  int i, s;
+  memset(m, 0, n);
+  for (s = 0; s < 8; s++)
+    for (i = 0; i < n; i++)
+      m[i] |= attr[s][i] == value;
+} /*match_audio*/
+
+static void match_lang(uint8_t *m, uint16_t (*lang)[BATCH], int nstreams, int n, int value)
+{
+  int i, s;
+  memset(m, 0, n);
+  for (s = 0; s < nstreams; s++)
+    for (i = 0; i < n; i++)
+      m[i] |= lang[s][i] == value;
+} /*match_lang*/
+
+static void eval_term(uint8_t *match, struct attrbatch *b, const struct term *t)
+/* ANDs the result of t for every titleset in b into match. */
+{
+  uint8_t m[BATCH];
+  const uint8_t flip = t->negate;
+  int i;
+  switch (t->kind)
+    {
+    case T_VMPEG: match_video(m, b->vmpeg, b->n, t->value); break;
+    case T_VRES: match_video(m, b->vres, b->n, t->value); break;
+    case T_VFORMAT: match_video(m, b->vformat, b->n, t->value); break;
+    case T_VASPECT: match_video(m, b->vaspect, b->n, t->value); break;
+    case T_VWIDESCREEN: match_video(m, b->vwidescreen, b->n, t->value); break;
+    case T_AFORMAT: match_audio(m, b->aformat, b->n, t->value); break;
+    case T_AQUANT: match_audio(m, b->aquant, b->n, t->value); break;
+    case T_ADOLBY: match_audio(m, b->adolby, b->n, t->value); break;
+    case T_ACHANNELS: match_audio(m, b->achannels, b->n, t->value); break;
+    case T_ALANGPRESENT: match_audio(m, b->alangpresent, b->n, t->value); break;
+    case T_ASAMPLE: match_audio(m, b->asample, b->n, t->value); break;
+    case T_ACONTENT: match_audio(m, b->acontent, b->n, t->value); break;
+    case T_ALANG: match_lang(m, b->alang, 8, b->n, t->value); break;
+    case T_SLANG: match_lang(m, b->slang, 32, b->n, t->value); break;
+    } /*switch*/
+  for (i = 0; i < b->n; i++)
+    match[i] &= m[i] ^ flip;
+} /*eval_term*/
+
+static void print_titleset(const struct mkcat_header *hdr, const struct mkcat_titleset *ts)
+/* prints a matching titleset, decoding its attributes in full. */
+{
+  const struct mkcat_disc * const disc =
+      (const struct mkcat_disc *)((const char *)hdr + hdr->discs_offset) + ts->disc;
+  struct videodesc vd;
+  struct audiodesc ad;
+  struct subpicdesc sd;
+  int s;
+
+  vtsattr_decode_video(ts->title_video, &vd);
+  printf
+    (
+      "%s VTS_%02d: %s %s %s",
+      (const char *)hdr + hdr->strings_offset + disc->name,
+      ts->vtsn,
+      vmpegdesc[vd.vmpeg],
+      vformatdesc[vd.vformat],
+      vaspectdesc[vd.vaspect]
+    );
+  for (s = 0; s < ts->numaudio; s++)
+    {
+      vtsattr_decode_audio(ts->audio[s], &ad);
+      printf
+        (
+          "%s %s %s",
+          s ? "," : "; audio",
+          ad.aformat ? aformatdesc[ad.aformat] : "unknown",
+          achanneldesc[ad.achannels]
+        );
+      if (ad.alangpresent == 2)
+        printf(" %.2s", ad.lang);
+    } /*for*/
+  for (s = 0; s < ts->numsubp; s++)
+    {
+      vtsattr_decode_subpic(ts->subp[s], &sd);
+      printf("%s %.2s", s ? "," : "; subpictures", sd.slangpresent == 2 ? sd.lang : "--");
+    } /*for*/
+  printf("\n");
+} /*print_titleset*/
+
+int catalog_query(const char *fname, const char *query)
+/* lists all titlesets in the catalog matching all the comma-separated terms of query.
+   Returns the number of matches. */
+{
+  const struct mkcat_header * const hdr = catalog_map(fname);
+  const struct mkcat_titleset * const titlesets =
+      (const struct mkcat_titleset *)((const char *)hdr + hdr->titlesets_offset);
+  struct attrbatch *b;
+  struct term *terms;
+  int numterms = 0, found = 0, i, j;
+  uint64_t first;
+  char *words, *word, *save;
+  uint8_t match[BATCH];
+
+  terms = malloc((strlen(query) / 2 + 1) * sizeof(struct term));
+  words = strdup(query);
+  for (word = strtok_r(words, ",", &save); word; word = strtok_r(0, ",", &save))
+    {
+      if (!parse_term(word, &terms[numterms]))
+        {
+          fprintf(stderr, "ERR:  unrecognized query term \"%s\"\n", word);
+          exit(1);
+        } /*if*/
+      numterms++;
+    } /*for*/
+  free(words);
+
+  b = malloc(sizeof(struct attrbatch));
+  for (first = 0; first < hdr->numtitlesets; first += BATCH)
+    {
+      const int n = hdr->numtitlesets - first < BATCH ? hdr->numtitlesets - first : BATCH;
+      decode_batch(b, titlesets + first, n);
+      memset(match, 1, n);
+      for (j = 0; j < numterms; j++)
+        eval_term(match, b, &terms[j]);
+      for (i = 0; i < n; i++)
+        if (match[i])
+          {
+            print_titleset(hdr, titlesets + first + i);
+            found++;
+          } /*if; for*/
+    } /*for*/
+  fprintf(stderr, "INFO: %d of %lu titlesets match\n", found, (unsigned long)hdr->numtitlesets);
+  free(b);
+  free(terms);
+  catalog_unmap(hdr);
+  return found;
+} /*catalog_query*/
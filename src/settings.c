@@ -0,0 +1,38 @@
+/*
+    settings shared between the command-line interface and the rest of mkinfo
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+/*
+    These are set from the command line by dvdcli.c. They live here rather
+    than there so that other programs built from the same sources, such as
+    the ones run by "make check", get them without having to define them.
+*/
+
+#include "config.h"
+#include "compat.h"
+
+#include <stddef.h>
+
+#include "mkinfo.h"
+
+int default_video_format = VF_NTSC; /* HACK: getratecode used to force this on every call */
+bool repair_ifo = false;
+double job_deadline = 0;
+enum scan_io scan_io = SCAN_IO_CACHED;
+int hedge_percentile = 0; /* for --hedge, 0 for no hedging */
@@ -0,0 +1,277 @@
+/*
+    mkinfo -- marking generated VMGs with what they were generated from, so
+    that ones still up to date can be recognised cheaply
+*/
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ * USA
+ */
+
+/*
+    Once a VMG has been written, the VIDEO_TS directory it went into is given
+    an extended attribute user.mkinfo.vmg holding
+
+        mkinfo-<version> <crc> <vmg crc> <source mtime> <output mtime>
+
+    where <crc> is the CRC-32C of the names, sizes and modification times of
+    the titleset files it was generated from, <vmg crc> is that of the
+    VIDEO_TS.IFO written, and the mtimes are those of the VIDEO_TS directory
+    the titlesets are in and of the one the VMG went into (the same unless
+    --output-root is used), as seconds.nanoseconds.
+
+    If neither directory has been modified since, the VMG is up to date, and
+    nothing more need be looked at. Otherwise the titleset files are listed
+    again and checked against the CRC, and the stamp brought up to date if
+    they still match. A titleset file rewritten in place, rather than replaced
+    by renaming, doesn't change its directory's modification time, so is only
+    noticed once something else does.
+
+    Before an out-of-date VMG is replaced, VIDEO_TS.IFO is checked against
+    <vmg crc>: the attribute stays with the directory whatever happens to the
+    files in it, and a VIDEO_TS.IFO put there since by something else is not
+    mkinfo's to overwrite.
+*/
+
+#include "config.h"
+#include "compat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+
+#include "mkinfo.h"
+#include "mi-internal.h"
+
+#define STAMP_ATTR "user.mkinfo.vmg"
+#define STAMP_GENERATOR "mkinfo-" VERSION
+#define STAMP_SIZE 128 /* room for a stamp */
+
+#ifdef HAVE_FSETXATTR
+
+static int open_vtsdir(const char *base)
+/* opens the VIDEO_TS directory in base. */
+{
+  char * const vtsdir = malloc(strlen(base) + 10);
+  int fd;
+  sprintf(vtsdir, "%s/VIDEO_TS", base);
+  fd = scan_openat(AT_FDCWD, vtsdir, O_RDONLY | O_DIRECTORY);
+  free(vtsdir);
+  return fd;
+} /*open_vtsdir*/
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+} /*compare_names*/
+
+static bool inputs_crc(int dirfd, uint32_t *crc)
+/* computes the CRC of the names, sizes and modification times of the titleset
+   files in dirfd, in order of name. */
+{
+  DIR * const d = fdopendir(dup(dirfd));
+  struct dirent *de;
+  char **names = 0;
+  size_t numnames = 0, maxnames = 0, i;
+  bool ok = d != 0;
+
+  io_delay(IO_READDIR);
+  while (ok && (de = readdir(d)) != 0)
+    {
+      if (strncasecmp(de->d_name, "VTS_", 4) != 0)
+        continue;
+      if (numnames == maxnames)
+        {
+          maxnames = maxnames ? maxnames * 2 : 64;
+          names = realloc(names, maxnames * sizeof(char *));
+        } /*if*/
+      names[numnames++] = strdup(de->d_name);
+    } /*while*/
+  if (d)
+    closedir(d);
+  qsort(names, numnames, sizeof(char *), compare_names);
+  *crc = 0;
+  for (i = 0; i < numnames; i++)
+    {
+      struct stat st;
+      char line[NAME_MAX + 64];
+      int len;
+      if (ok && fstatat(dirfd, names[i], &st, 0) == 0)
+        {
+          len = snprintf
+            (
+              line, sizeof line, "%s %lld %lld.%09ld\n",
+              names[i], (long long)st.st_size,
+              (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec
+            );
+          *crc = crc32c(*crc, line, len);
+        }
+      else
+        ok = false;
+      free(names[i]);
+    } /*for*/
+  free(names);
+  return ok;
+} /*inputs_crc*/
+
+static bool vmg_crc(int outfd, uint32_t *crc)
+/* computes the CRC of the VIDEO_TS.IFO in outfd, returning false if it can't be read. */
+{
+  const int fd = scan_openat(outfd, "VIDEO_TS.IFO", O_RDONLY);
+  void *buf;
+  off_t offset = 0;
+  ssize_t n = -1;
+  if (fd < 0)
+    return false;
+  if (posix_memalign(&buf, SCAN_ALIGN, 65536) == 0)
+    {
+      *crc = 0;
+      while ((n = scan_pread(fd, buf, 65536, offset)) > 0)
+        {
+          *crc = crc32c(*crc, buf, n);
+          offset += n;
+        } /*while*/
+      free(buf);
+    } /*if*/
+  close(fd);
+  return n == 0;
+} /*vmg_crc*/
+
+static bool make_stamp(int srcfd, int outfd, uint32_t crc, uint32_t vmgcrc, char *stamp)
+/* puts together a stamp for a VMG with CRC vmgcrc in outfd generated from the
+   titlesets in srcfd with CRC crc. */
+{
+  struct stat src, out;
+  if (fstat(srcfd, &src) != 0 || fstat(outfd, &out) != 0)
+    return false;
+  snprintf
+    (
+      stamp, STAMP_SIZE, "%s %08x %08x %lld.%09ld %lld.%09ld",
+      STAMP_GENERATOR, crc, vmgcrc,
+      (long long)src.st_mtim.tv_sec, (long)src.st_mtim.tv_nsec,
+      (long long)out.st_mtim.tv_sec, (long)out.st_mtim.tv_nsec
+    );
+  return true;
+} /*make_stamp*/
+
+static void put_stamp(int outfd, const char *stamp, const char *outbase)
+{
+  io_delay(IO_WRITE);
+  if (fsetxattr(outfd, STAMP_ATTR, stamp, strlen(stamp), 0) != 0 && errno != ENOTSUP)
+    fprintf(stderr, "WARN: cannot stamp %s/VIDEO_TS: %s\n", outbase, strerror(errno));
+} /*put_stamp*/
+
+enum vmg_stamp vmg_stamp_check(const char *srcbase, const char *outbase)
+/* checks whether the VMG in outbase (srcbase if NULL) was generated by this
+   version of mkinfo from the titlesets currently in srcbase. */
+{
+  char stamp[STAMP_SIZE], current[STAMP_SIZE];
+  enum vmg_stamp result = VMG_STAMP_NONE;
+  const int outfd = open_vtsdir(outbase ? outbase : srcbase);
+  int srcfd = outfd;
+  unsigned int crc, vmgcrc;
+  uint32_t nowcrc, nowvmgcrc;
+  ssize_t len;
+
+  if (outfd < 0)
+    return VMG_STAMP_NONE;
+  do /*once*/
+    {
+      len = fgetxattr(outfd, STAMP_ATTR, stamp, sizeof stamp - 1);
+      if (len < 0)
+        break; /* not one of ours */
+      stamp[len] = 0;
+      if (outbase && (srcfd = open_vtsdir(srcbase)) < 0)
+        break;
+      if (sscanf(stamp, "%*s %8x %8x", &crc, &vmgcrc) != 2)
+        break; /* can't tell whether the VMG is still the one stamped */
+      if
+        (
+            strncmp(stamp, STAMP_GENERATOR " ", strlen(STAMP_GENERATOR) + 1) != 0
+        ||
+            !make_stamp(srcfd, outfd, crc, vmgcrc, current)
+        )
+        current[0] = 0; /* by another version, regenerate if still as it wrote it */
+      if (current[0] && !strcmp(stamp, current))
+        {
+          /* nothing touched since */
+          result = VMG_STAMP_CURRENT;
+          break;
+        } /*if*/
+      if
+        (
+            current[0]
+        &&
+            inputs_crc(srcfd, &nowcrc)
+        &&
+            nowcrc == crc
+        &&
+            faccessat(outfd, "VIDEO_TS.IFO", F_OK, 0) == 0
+        &&
+            faccessat(outfd, "VIDEO_TS.BUP", F_OK, 0) == 0
+        )
+        {
+          /* directories changed, but not in a way that matters */
+          result = VMG_STAMP_CURRENT;
+          put_stamp(outfd, current, outbase ? outbase : srcbase);
+        }
+      else if (vmg_crc(outfd, &nowvmgcrc) && nowvmgcrc == vmgcrc)
+        result = VMG_STAMP_STALE;
+      /* else gone, or not ours any more */
+    }
+  while (false);
+  if (srcfd >= 0 && srcfd != outfd)
+    close(srcfd);
+  close(outfd);
+  return result;
+} /*vmg_stamp_check*/
+
+void vmg_stamp_set(const char *srcbase, const char *outbase, unsigned int vmgcrc)
+/* marks the VMG with CRC vmgcrc just generated in outbase (srcbase if NULL) as
+   coming from the titlesets in srcbase. */
+{
+  char stamp[STAMP_SIZE];
+  const int outfd = open_vtsdir(outbase ? outbase : srcbase);
+  const int srcfd = outbase ? open_vtsdir(srcbase) : outfd;
+  uint32_t crc;
+  if (outfd >= 0 && srcfd >= 0 && inputs_crc(srcfd, &crc) && make_stamp(srcfd, outfd, crc, vmgcrc, stamp))
+    put_stamp(outfd, stamp, outbase ? outbase : srcbase);
+  if (srcfd >= 0 && srcfd != outfd)
+    close(srcfd);
+  if (outfd >= 0)
+    close(outfd);
+} /*vmg_stamp_set*/
+
+#else
+
+enum vmg_stamp vmg_stamp_check(const char *srcbase, const char *outbase)
+{
+  return VMG_STAMP_NONE;
+} /*vmg_stamp_check*/
+
+void vmg_stamp_set(const char *srcbase, const char *outbase, unsigned int vmgcrc)
+{
+} /*vmg_stamp_set*/
+
+#endif
@@ -0,0 +1,79 @@
+#!/bin/sh
+# Run by "make check": generates VMGs for a synthetic tree under fixed-seed
+# --io-latency profiles and checks what --timing reports, so that a change
+# that serialises the pipeline, or adds storage operations to each
+# directory, or hides stalls from the latency figures, shows up as a failure.
+
+tmp=timing-check.tmp
+numdirs=24
+profile=delay=2,jitter=1,seed=5
+
+fail()
+  {
+    echo "FAIL: $*" >&2
+    exit 1
+  }
+
+timing()
+  # runs mkinfo with --timing and the given options over the tree, writing
+  # under $tmp/$1, and prints the timing line
+  {
+    out=$1
+    shift
+    ./mkinfo --timing -o $tmp/$out "$@" $tmp/d* 2>$tmp/$out.log >/dev/null || fail "mkinfo $*: see $tmp/$out.log"
+    written=$(find $tmp/$out -name VIDEO_TS.IFO | wc -l)
+    [ $written -eq $numdirs ] || fail "mkinfo $*: $written VMGs written, not $numdirs"
+    line=$(grep '^INFO: timing:' $tmp/$out.log)
+    echo "$*: $line"
+  }
+
+field()
+  # extracts the number following word $1 in the timing line
+  {
+    echo "$line" | sed -n "s/.* $1 \([0-9.]*\) ms.*/\1/p"
+  }
+
+rate()
+  # extracts the directories per second from the timing line
+  {
+    echo "$line" | sed -n "s/.* \([0-9.]*\)\/s;.*/\1/p"
+  }
+
+check()
+  # fails unless awk expression $1 holds, with $2 as the explanation
+  {
+    awk "BEGIN {exit !($1)}" || fail "$2"
+  }
+
+rm -rf $tmp
+mkdir $tmp
+i=0
+while [ $i -lt $numdirs ]
+  do
+    ./mkdisc $tmp/d$i $((2 + i % 3)) $i || fail "mkdisc"
+    i=$((i + 1))
+  done
+
+# one directory at a time: every storage operation is held up by at least
+# 2 ms, and without stalls nothing should take much longer than the rest
+timing seq --io-latency=$profile
+seq_rate=$(rate)
+seq_p50=$(field p50)
+seq_p99=$(field p99)
+check "$seq_p50 >= 60" "median directory took $seq_p50 ms, less than the delays configured"
+check "$seq_p99 <= 3 * $seq_p50" "p99 of $seq_p99 ms is far above the median of $seq_p50 ms"
+
+# the pipeline should keep several directories waiting on storage at once
+timing pipe --io-latency=$profile --pipeline=2,4,2,4
+pipe_rate=$(rate)
+check "$pipe_rate >= 3 * $seq_rate" "pipeline managed $pipe_rate/s, not much more than $seq_rate/s one at a time"
+
+# occasional long stalls should show up in the tail, but not the median
+timing stall --io-latency=$profile,stall=0.5@300
+stall_p50=$(field p50)
+stall_max=$(field max)
+check "$stall_p50 < 300" "median directory took $stall_p50 ms, as though every one stalled"
+check "$stall_max >= 300" "slowest directory took $stall_max ms, so no stall was seen"
+
+rm -rf $tmp
+exit 0